@@ -6,13 +6,61 @@
 #include <iostream>
 #include <ctime>
 #include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include <ncurses.h>
 #include <fstream>
+#include <sstream>
+#include <functional>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <charconv>
+#include <climits>
+#include <cerrno>
+#include <atomic>
+#include <new>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <csignal>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 
 using namespace std;
 
+// Size of the board; can be overridden at compile time (e.g. -DWIDTH=1000 -DHEIGHT=1000)
+#ifndef WIDTH
 #define WIDTH 60
+#endif
+#ifndef HEIGHT
 #define HEIGHT 30
+#endif
+static_assert(WIDTH >= 5 && HEIGHT >= 5, "The board needs room for the player's 3x3 starting area inside the border");
+
+// Largest part of the board shown at once; the camera scrolls over boards larger than the terminal
+#define VIEW_MAX_WIDTH (WIDTH < 256 ? WIDTH : 256)
+#define VIEW_MAX_HEIGHT (HEIGHT < 96 ? HEIGHT : 96)
+#define CAMERA_MARGIN 5     // Cells kept between the player and the edge of the view before it scrolls
+#define CHUNK_SIZE 16       // Side of the squares the enemies are indexed by, for culling them to the view
+#define CHUNK_COLS ((WIDTH + CHUNK_SIZE - 1) / CHUNK_SIZE)
+#define CHUNK_ROWS ((HEIGHT + CHUNK_SIZE - 1) / CHUNK_SIZE)
 
 // Define symbols for each entity
 #define PLAYER 'P'
@@ -24,6 +72,12 @@ using namespace std;
 #define TRAP 'T'
 
 #define NUM_BOMBS 3     // Number of bombs the player can plant at a time
+#define MAX_PLAYERS 4   // Players of a network game; a local game has one
+#define MAX_BOMBS (NUM_BOMBS * MAX_PLAYERS) // Bombs on the board at a time
+#define TICK_MS 50          // Length of a game tick in milliseconds
+#define BOMB_FUSE_TICKS (3000 / TICK_MS)    // Bombs explode 3 seconds after they are planted
+#define AUTOSAVE_TICKS 600  // Ticks between two autosaves (30 seconds at 20 ticks per second)
+#define MAX_BOARD_ATTEMPTS 1000 // Boards generated before the exit is put in the player's starting area
 
 /*
 -------------------------------------------------- Entity Class --------------------------------------------------
@@ -37,10 +91,11 @@ class Entity {
 protected:
     int x, y;       // Position Coordinates
     char symbol;    // Symbol to represent the entity on the grid
+    uint32_t changedTick;   // First game state that shows the latest change, for network replication
 
 public:
     // Constructor
-    Entity(int x, int y, char symbol) : x(x), y(y), symbol(symbol) {
+    Entity(int x, int y, char symbol) : x(x), y(y), symbol(symbol), changedTick(0) {
         // Initialize the entity with the given position and symbol
     }
     // Destructor
@@ -51,6 +106,10 @@ public:
     int getY() const { return y; }
     char getSymbol() const { return symbol; }
 
+    // Getter and setter for the tick the entity last changed on
+    uint32_t getChangedTick() const { return changedTick; }
+    void setChangedTick(uint32_t value) { changedTick = value; }
+
     // Move the entity by dx and dy; will be same for all entities
     virtual void move(int dx, int dy) {
         x += dx;
@@ -68,10 +127,24 @@ public:
 class Player : public Entity {
 private:
     int hasBombs;           // Number of bombs the player has
+    bool alive;             // Still on the board; the players of a network game drop out when they die or leave
+    uint32_t lastInput;     // Sequence of the last network input applied to the player
 
 public:
     // Constructor
-    Player(int x, int y) : Entity(x, y, PLAYER), hasBombs(NUM_BOMBS) {}
+    Player(int x, int y) : Entity(x, y, PLAYER), hasBombs(NUM_BOMBS), alive(true), lastInput(0) {}
+
+    // Getter and setter for the number of bombs in hand
+    int getBombs() const { return hasBombs; }
+    void setBombs(int bombs) { hasBombs = bombs; }
+
+    // Getter and setter for whether the player is still on the board
+    bool isAlive() const { return alive; }
+    void setAlive(bool value) { alive = value; }
+
+    // Getter and setter for the last network input applied
+    uint32_t getLastInput() const { return lastInput; }
+    void setLastInput(uint32_t sequence) { lastInput = sequence; }
 
     // Check if the player can plant a bomb
     bool canPlantBomb() const {
@@ -82,57 +155,93 @@ public:
         hasBombs--;
     }
     // Reload a bomb, after a bomb has exploded; restore that bomb
+    // (a player who took over a network slot may get back bombs planted before it joined)
     void reloadBomb() {
-        hasBombs++;
+        if (hasBombs < NUM_BOMBS) hasBombs++;
     }
 };
 
+// Where the player of each slot starts: the corners of the area every random board keeps clear in its top left
+static const int SPAWN_X[MAX_PLAYERS] = {1, 3, 1, 3};
+static const int SPAWN_Y[MAX_PLAYERS] = {1, 1, 3, 3};
+
 /*
 -------------------------------------------------- Enemy Class --------------------------------------------------
 */
 
+// Enemy archetypes; the value is the moveType stored in save files
+enum EnemyType {
+    ENEMY_HORIZONTAL,   // Moves left or right at random
+    ENEMY_VERTICAL,     // Moves up or down at random
+    ENEMY_WANDERER,     // Moves in any of the four directions at random
+    ENEMY_CHASER,       // Closes in on the (nearest) player
+    ENEMY_PATROLLER,    // Walks straight ahead and turns around at obstacles
+    ENEMY_WALL_HUGGER,  // Follows the wall on its left
+    ENEMY_BOMB_AVOIDER, // Wanders, but steps out of the blast lines of planted bombs
+    NUM_ENEMY_TYPES
+};
+
+// Number of game ticks between two moves of each archetype (the original enemies moved every 11th tick)
+static const int ENEMY_MOVE_PERIOD[NUM_ENEMY_TYPES] = {11, 11, 11, 14, 9, 10, 8};
+
+#define SCHEDULE_SLOTS 16   // Slots in the movement scheduler; must be larger than every move period
+
 class Enemy : public Entity {
 private:
-    int moveType;       // Type of movement for the enemy (0: Horizontal, 1: Vertical, 2: Both)
-    int moveStep;       // Counter to control the movement of the enemy
+    int moveType;       // Archetype of the enemy (see EnemyType)
+    int dirX, dirY;     // Current heading, used by the archetypes that keep walking in one direction
+    int slot;           // Movement scheduler slot the enemy is waiting in (-1 if not scheduled)
+    int slotIndex;      // Position of the enemy inside that slot
+    int rosterIndex;    // Position of the enemy in the game's enemies array
+    int chunk;          // Spatial index chunk the enemy is listed in (-1 if not indexed)
+    int chunkIndex;     // Position of the enemy inside that chunk
+    int id;             // Number of the enemy on its board, which (unlike rosterIndex) never changes
 
 public:
     // Constructor
-    Enemy(int x, int y, int type) : Entity(x, y, ENEMY), moveType(type), moveStep(0) {}
-
-    // Update the enemy's position based on the moveType
-    void update() override {
-        // Move the enemy every 10th update
-        if(moveStep++ != 10) {
-            return;
+    Enemy(int x, int y, int type)
+        : Entity(x, y, ENEMY), moveType(type), dirX(1), dirY(0), slot(-1), slotIndex(0), rosterIndex(-1),
+          chunk(-1), chunkIndex(0), id(-1) {
+        // Unknown types (e.g. from a corrupted save) fall back to horizontal movement
+        if (moveType < 0 || moveType >= NUM_ENEMY_TYPES) {
+            moveType = ENEMY_HORIZONTAL;
         }
-        // Reset the moveStep counter
-        moveStep = 0;
-        int dx = 0, dy = 0;
-        int randomMove = rand() % 4; // 0: up, 1: right, 2: down, 3: left
+    }
 
-        switch (moveType) {
-            case 0: // Horizontal Movement
-                // (randomMove == 0 || randomMove == 1) -> Move right
-                // (randomMove == 2 || randomMove == 3) -> Move left
-                dx = (randomMove == 0 || randomMove == 1) ? 1 : ((randomMove == 2 || randomMove == 3) ? -1 : 0);
-                break;
-            case 1: // Vertical Movement
-                // (randomMove == 0 || randomMove == 1) -> Move up
-                // (randomMove == 2 || randomMove == 3) -> Move down
-                dy = (randomMove == 0 || randomMove == 1) ? -1 : ((randomMove == 2 || randomMove == 3) ? 1 : 0);
-                break;
-            case 2: // Both
-                dx = (randomMove == 0 || randomMove == 1) ? 1 : ((randomMove == 2 || randomMove == 3) ? -1 : 0);
-                dy = (randomMove == 0 || randomMove == 1) ? -1 : ((randomMove == 2 || randomMove == 3) ? 1 : 0);
-                break;
-        }
-        // Move the enemy
-        move(dx, dy);
+    // Getters and setter for the scheduler position
+    int getSlot() const { return slot; }
+    int getSlotIndex() const { return slotIndex; }
+    void setSlot(int slot, int index) {
+        this->slot = slot;
+        slotIndex = index;
+    }
+
+    // Getter and setter for the position in the enemies array
+    int getRosterIndex() const { return rosterIndex; }
+    void setRosterIndex(int index) { rosterIndex = index; }
+
+    // Getter and setter for the id
+    int getId() const { return id; }
+    void setId(int value) { id = value; }
+
+    // Getters and setter for the spatial index position
+    int getChunk() const { return chunk; }
+    int getChunkIndex() const { return chunkIndex; }
+    void setChunk(int chunk, int index) {
+        this->chunk = chunk;
+        chunkIndex = index;
     }
 
     // Getter for moveType
     int getMoveType() const { return moveType; }
+
+    // Getters and setter for the heading
+    int getDirX() const { return dirX; }
+    int getDirY() const { return dirY; }
+    void setHeading(int dx, int dy) {
+        dirX = dx;
+        dirY = dy;
+    }
 };
 
 /*
@@ -141,17 +250,42 @@ public:
 
 class Bomb : public Entity {
 private:
-    // Time when the bomb was planted
-    chrono::steady_clock::time_point plantTime;
+    // Game ticks left before the bomb explodes.
+    // The fuse burns in ticks rather than wall-clock time, so a replay explodes every bomb on the same tick.
+    int fuseTicks;
+    int owner;      // Slot of the player who planted it, and gets it back when it explodes
+    uint32_t id;    // Number of the bomb in its game, for network replication
 
 public:
     // Constructor
-    Bomb(int x, int y) : Entity(x, y, BOMB), plantTime(chrono::steady_clock::now()) {}
+    Bomb(int x, int y, int owner = 0) : Entity(x, y, BOMB), fuseTicks(BOMB_FUSE_TICKS), owner(owner), id(0) {}
+    // Constructor for a bomb that already burnt part of its fuse (e.g. restored from a save)
+    Bomb(int x, int y, int fuseMs, int owner)
+        : Entity(x, y, BOMB), fuseTicks((fuseMs + TICK_MS - 1) / TICK_MS), owner(owner), id(0) {}
+
+    // Getter for the owner
+    int getOwner() const { return owner; }
+
+    // Getter and setter for the id
+    uint32_t getId() const { return id; }
+    void setId(uint32_t value) { id = value; }
+
+    // Getter for the ticks left on the fuse
+    int getFuseTicks() const { return fuseTicks; }
+
+    // Burn the fuse by one tick
+    void burn() {
+        if (fuseTicks > 0) fuseTicks--;
+    }
 
     // Check if the bomb should explode
     bool shouldExplode() const {
-        auto now = chrono::steady_clock::now();
-        return chrono::duration_cast<chrono::seconds>(now - plantTime).count() >= 3;    // Explode after 3 seconds
+        return fuseTicks <= 0;
+    }
+
+    // Milliseconds left before the bomb explodes (0 once it is due)
+    int fuseRemainingMs() const {
+        return fuseTicks * TICK_MS;
     }
 };
 
@@ -230,527 +364,6835 @@ public:
 };
 
 /*
--------------------------------------------------- Game Class --------------------------------------------------
+-------------------------------------------------- Binary Save Format --------------------------------------------------
 */
 
-class Game {
-private:
-    string saveFileName = "game_save.txt";
-    
-    Entity*** grid;     // 2D array of Entity pointers
-    Player* player;     // Pointer to the player object
-    Enemy** enemies;    // Array of pointers to enemy objects
-    int enemyCount;     // Number of enemies
-    Bomb** bombs;       // Array of pointers to bomb objects
-    int bombCount;      // Number of bombs
-    ExitDoor* exitDoor; // Pointer to the exit door object
-    int bombsPlanted;   // Number of bombs planted by the player
-
-    // Function to clear the screen and display the menu
-    void displayMenu() {
-        clear();
-        mvprintw(HEIGHT / 2 - 2, WIDTH / 2 - 10, "1. Start a new game");
-        mvprintw(HEIGHT / 2 - 1, WIDTH / 2 - 10, "2. Load previous game");
-        mvprintw(HEIGHT / 2, WIDTH / 2 - 10, "3. Exit");
-        refresh();
-    }
-
-    // Function to save the game state to a file
-    void saveGame() {
-        ofstream saveFile(saveFileName);
-        if (saveFile.is_open()) {
-            // Save player position
-            saveFile << player->getX() << " " << player->getY() << "\n";
+// Layout of a binary save file (all fields little-endian, as written by the host):
+//   SaveHeader                 fixed size, at offset 0
+//   tiles[HEIGHT][WIDTH]       one symbol byte per tile, at header.tilesOffset (possibly compressed, see flags)
+//   SaveEnemy[enemyCount]      at header.enemiesOffset (8-byte aligned)
+//   SaveBomb[bombCount]        at header.bombsOffset (8-byte aligned)
+// The loader maps the file and reads the tables in place; it only checks that the offsets and counts
+// describe tables that fit in the file, so there is no parsing pass.
+// The green block over a hidden exit is stored as a plain destructible block, like in the text save.
 
-            // Save bombs planted
-            saveFile << bombsPlanted << "\n";
+#define SAVE_MAGIC 0x56534D42   // "BMSV"
+#define SAVE_VERSION 2     // Version 2 added compressed tile sections; version 1 files still load
 
-            // Save enemy positions
-            saveFile << enemyCount << "\n";
-            for (int i = 0; i < enemyCount; i++) {
-                saveFile << enemies[i]->getX() << " " << enemies[i]->getY() << " " << enemies[i]->getMoveType() << "\n";
-            }
+struct SaveHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;        // sizeof(SaveHeader) of the writer
+    uint16_t width, height;
+    uint32_t flags;             // Tile section encoding (SAVE_FLAG_*; 0 for raw tiles)
+    int32_t playerX, playerY;
+    int32_t bombsPlanted;
+    uint32_t enemyCount;
+    uint32_t bombCount;
+    int32_t exitX, exitY;
+    uint32_t exitVisible;
+    uint64_t tilesOffset;
+    uint64_t enemiesOffset;
+    uint64_t bombsOffset;
+    uint64_t fileSize;          // Total size, so truncated files are rejected
+};
 
-            // Save bomb positions
-            saveFile << bombCount << "\n";
-            for (int i = 0; i < bombCount; i++) {
-                saveFile << bombs[i]->getX() << " " << bombs[i]->getY() << "\n";
-            }
+struct SaveEnemy {
+    int32_t x, y;
+    int32_t type;
+    int8_t dirX, dirY;
+    uint16_t reserved;
+};
 
-            // Save exit door position
-            saveFile << exitDoor->getX() << " " << exitDoor->getY() << " " << exitDoor->isVisible() << "\n";
+struct SaveBomb {
+    int32_t x, y;
+    int32_t fuseMs;             // Fuse time left when the game was saved
+    uint32_t owner;             // Player slot that planted it (0 in single player games and older files)
+};
 
-            // Save grid state
-            for (int i = 0; i < HEIGHT; i++) {
-                for (int j = 0; j < WIDTH; j++) {
-                    if (grid[i][j]) {
-                        saveFile << grid[i][j]->getSymbol();
-                    } else {
-                        saveFile << ' ';
-                    }
-                }
-                saveFile << "\n";
-            }
+static_assert(sizeof(SaveHeader) == 80, "SaveHeader layout changed; bump SAVE_VERSION");
+static_assert(sizeof(SaveEnemy) == 16, "SaveEnemy layout changed; bump SAVE_VERSION");
+static_assert(sizeof(SaveBomb) == 16, "SaveBomb layout changed; bump SAVE_VERSION");
 
-            saveFile.close();
-            mvprintw(HEIGHT + 1, 0, "Game saved successfully!");
-            refresh();
-        } else {
-            mvprintw(HEIGHT + 1, 0, "Unable to save game!");
-            refresh();
-        }
-    }
+// Round a file offset up to the next multiple of 8
+static uint64_t alignSaveOffset(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
 
-    // Function to load the game state from a file
-    bool loadGame() {
-        ifstream loadFile(saveFileName);
-        if (loadFile.is_open()) {
-            // Clear existing game state
-            for (int i = 0; i < HEIGHT; i++) {
-                for (int j = 0; j < WIDTH; j++) {
-                    delete grid[i][j];
-                    grid[i][j] = nullptr;
-                }
-            }
-            for (int i = 0; i < enemyCount; i++) {
-                delete enemies[i];
-            }
-            delete[] enemies;
-            for (int i = 0; i < bombCount; i++) {
-                delete bombs[i];
-            }
-            delete[] bombs;
+/*
+-------------------------------------------------- Tile Compression --------------------------------------------------
+*/
 
-            // Load player position
-            int playerX, playerY;
-            loadFile >> playerX >> playerY;
-            delete player;
-            player = new Player(playerX, playerY);
+// The tile section of a binary save can be compressed (SaveHeader::flags):
+//  - SAVE_FLAG_RLE_TILES: run-length encoding. A control byte c < 128 repeats the next byte c + 1 times,
+//    c >= 128 is followed by c - 127 literal bytes.
+//  - SAVE_FLAG_LZ_TILES: LZ77 over a LZ_WINDOW byte window. A control byte c < 128 is followed by c + 1
+//    literal bytes, c >= 128 copies (c & 127) + LZ_MIN_MATCH bytes from a u16 distance back
+//    (the copy may overlap itself, which also covers runs).
+// Encoders take the tiles one row at a time and decoders hand them back one row at a time, so neither side
+// ever holds the whole uncompressed tile array.
 
-            // Load bombs planted
-            loadFile >> bombsPlanted;
+#define SAVE_FLAG_RLE_TILES 1
+#define SAVE_FLAG_LZ_TILES 2
 
-            // Load enemy positions
-            loadFile >> enemyCount;
-            enemies = new Enemy*[enemyCount];
-            for (int i = 0; i < enemyCount; i++) {
-                int x, y, moveType;
-                loadFile >> x >> y >> moveType;
-                enemies[i] = new Enemy(x, y, moveType);
-            }
+#define LZ_WINDOW 4096
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (127 + LZ_MIN_MATCH)
+#define LZ_HASH_SIZE 4096
 
-            // Load bomb positions
-            loadFile >> bombCount;
-            bombs = new Bomb*[bombCount];
-            for (int i = 0; i < bombCount; i++) {
-                int x, y;
-                loadFile >> x >> y;
-                bombs[i] = new Bomb(x, y);
-            }
+class RleEncoder {
+private:
+    vector<unsigned char>& out;
+    unsigned char literals[128];
+    int literalCount;
+    unsigned char runByte;
+    int runLength;
 
-            // Load exit door position
-            int exitX, exitY;
-            bool visible;
-            loadFile >> exitX >> exitY >> visible;
-            delete exitDoor;
-            exitDoor = new ExitDoor(exitX, exitY);
-            exitDoor->setVisible(visible);
+    void flushLiterals() {
+        if (literalCount == 0) return;
+        out.push_back(127 + literalCount);
+        out.insert(out.end(), literals, literals + literalCount);
+        literalCount = 0;
+    }
 
-            // Load grid state
-            loadFile.ignore(); // Ignore newline
-            for (int i = 0; i < HEIGHT; i++) {
-                string line;
-                getline(loadFile, line);
-                for (int j = 0; j < WIDTH; j++) {
-                    char symbol = line[j];
-                    switch (symbol) {
-                        case INDESTRUCTIBLE_BLOCK:
-                            grid[i][j] = new IndestructibleBlock(j, i);
-                            break;
-                        case DESTRUCTIBLE_BLOCK:
-                            grid[i][j] = new DestructibleBlock(j, i);
-                            break;
-                        case TRAP:
-                            grid[i][j] = new Trap(j, i);
-                            break;
-                        case EXIT_DOOR:
-                            grid[i][j] = exitDoor; // Place the exit door in the grid
-                        break;
-                    }
-                }
+    // Emit the current run; runs too short to pay off become literals
+    void flushRun() {
+        if (runLength >= 3) {
+            flushLiterals();
+            out.push_back(runLength - 1);
+            out.push_back(runByte);
+        } else {
+            for (int i = 0; i < runLength; i++) {
+                literals[literalCount++] = runByte;
+                if (literalCount == 128) flushLiterals();
             }
-
-            // Make the green brick on the exit door, if it is not visible
-            if(!exitDoor->isVisible())
-                grid[exitY][exitX] = new DestructibleBlock(exitX, exitY, true);
-
-            loadFile.close();
-            return true;
         }
-        return false;
+        runLength = 0;
     }
 
 public:
-    // Constructor
-    Game() : player(nullptr), exitDoor(nullptr), enemyCount(0), bombCount(0) {
-        // Initialize the grid with nullptr
-        grid = new Entity**[HEIGHT];
-        for (int i = 0; i < HEIGHT; i++) {
-            grid[i] = new Entity*[WIDTH];
-            for (int j = 0; j < WIDTH; j++) {
-                grid[i][j] = nullptr;
-            }
-        }
-        initializeGame();
-    }
+    explicit RleEncoder(vector<unsigned char>& out) : out(out), literalCount(0), runByte(0), runLength(0) {}
 
-    // Destructor
-    ~Game() {
-        // Delete all entities and deallocate memory
-        for (int i = 0; i < HEIGHT; i++) {
-            for (int j = 0; j < WIDTH; j++) {
-                delete grid[i][j];
+    void put(const unsigned char* data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            if (runLength > 0 && (data[i] != runByte || runLength == 128)) {
+                flushRun();
             }
-            delete[] grid[i];
-        }
-        delete[] grid;
-        delete player;
-        delete exitDoor;
-        for (int i = 0; i < enemyCount; i++) {
-            delete enemies[i];
-        }
-        delete[] enemies;
-        for (int i = 0; i < bombCount; i++) {
-            delete bombs[i];
+            runByte = data[i];
+            runLength++;
         }
-        delete[] bombs;
     }
 
-    // Function to display the game over screen
-    void gameOver(string causeOfDeath) {
-        clear();
-        string toDisplay = "GAME OVER! " + causeOfDeath;
-        mvprintw(HEIGHT / 2, WIDTH / 2 - 5, toDisplay.c_str());
-        refresh();
-        nodelay(stdscr, FALSE);
-        getch();
-        endwin();
-        exit(0);
+    void finish() {
+        flushRun();
+        flushLiterals();
     }
+};
 
-    // Function to display the game win screen
-    void gameWin() {
-        clear();
-        mvprintw(HEIGHT / 2, WIDTH / 2 - 5, "YOU WIN!");
-        refresh();
-        nodelay(stdscr, FALSE);
-        getch();
-        endwin();
-        exit(0);
-    }
+class RleDecoder {
+private:
+    const unsigned char* in;
+    size_t size;
+    size_t pos;
+    int runLeft;
+    int literalLeft;
+    unsigned char runByte;
 
-    // Function to initialize the game
-    void initializeGame() {
-        player = new Player(1, 1);
-        bombsPlanted = 0;
+public:
+    RleDecoder(const unsigned char* in, size_t size) : in(in), size(size), pos(0), runLeft(0), literalLeft(0), runByte(0) {}
 
-        // Adding blocks
-        for (int i = 0; i < HEIGHT; i++) {
-            for (int j = 0; j < WIDTH; j++) {
-                // Adding indestructible blocks around the border
-                if (i == 0 || i == HEIGHT - 1 || j == 0 || j == WIDTH - 1) {
-                    grid[i][j] = new IndestructibleBlock(j, i);
-                }
-                // Adding destructible blocks randomly
-                else if (rand() % WIDTH == 0) {
-                    grid[i][j] = new IndestructibleBlock(j, i);
-                }
-                // Adding destructible blocks randomly
-                else if (rand() % HEIGHT == 0) {
-                    grid[i][j] = new DestructibleBlock(j, i);
+    // Produce exactly n bytes; false if the input ends or is malformed
+    bool read(unsigned char* dest, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (runLeft == 0 && literalLeft == 0) {
+                if (pos >= size) return false;
+                int control = in[pos++];
+                if (control < 128) {
+                    if (pos >= size) return false;
+                    runLeft = control + 1;
+                    runByte = in[pos++];
+                } else {
+                    literalLeft = control - 127;
                 }
             }
+            if (runLeft > 0) {
+                dest[i] = runByte;
+                runLeft--;
+            } else {
+                if (pos >= size) return false;
+                dest[i] = in[pos++];
+                literalLeft--;
+            }
         }
+        return true;
+    }
+};
 
-        // Adding traps
-        for (int i = 0; i < (HEIGHT + WIDTH) / 10; i++) {
-            int x, y;
-            // Randomly select a position for the trap
-            do {
-                x = rand() % (WIDTH - 2) + 1;
-                y = rand() % (HEIGHT - 2) + 1;
-            } while (grid[y][x] != nullptr || (x == 1 && y == 1));
-            grid[y][x] = new Trap(x, y);
-        }
+class LzEncoder {
+private:
+    vector<unsigned char>& out;
+    vector<unsigned char> data;     // Window behind pos plus the input not encoded yet
+    size_t base;                    // Stream position of data[0]
+    size_t pos;                     // Next stream position to encode
+    long head[LZ_HASH_SIZE];        // Last stream position with each 3-byte hash
+    unsigned char literals[128];
+    int literalCount;
 
-        // Add enemies
-        enemyCount = (HEIGHT + WIDTH) / 10;
-        enemies = new Enemy*[enemyCount];
-        for (int i = 0; i < enemyCount; i++) {
-            int x, y;
-            do {
-                x = rand() % (WIDTH - 2) + 1;
-                y = rand() % (HEIGHT - 2) + 1;
-            } while (grid[y][x] != nullptr || (x == 1 && y == 1));
-            enemies[i] = new Enemy(x, y, i % 3);
-        }
+    unsigned char at(size_t streamPos) const { return data[streamPos - base]; }
 
-        // Clear player's starting area; player starts at (1, 1)
-        for (int i = 1; i <= 3; i++) {
-            for (int j = 1; j <= 3; j++) {
-                delete grid[i][j];
-                grid[i][j] = nullptr;
+    static int hash(const unsigned char* p) {
+        return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u >> 20) & (LZ_HASH_SIZE - 1);
+    }
+
+    void flushLiterals() {
+        if (literalCount == 0) return;
+        out.push_back(literalCount - 1);
+        out.insert(out.end(), literals, literals + literalCount);
+        literalCount = 0;
+    }
+
+    // Encode until fewer than LZ_MAX_MATCH bytes are buffered (or everything, when finishing)
+    void encode(bool finishing) {
+        size_t end = base + data.size();
+        while (pos < end && (finishing || end - pos >= LZ_MAX_MATCH)) {
+            int length = 0;
+            size_t distance = 0;
+            if (end - pos >= LZ_MIN_MATCH) {
+                int h = hash(&data[pos - base]);
+                long candidate = head[h];
+                head[h] = pos;
+                if (candidate >= (long)base && pos - candidate <= LZ_WINDOW) {
+                    size_t limit = min((size_t)LZ_MAX_MATCH, end - pos);
+                    while ((size_t)length < limit && at(candidate + length) == at(pos + length)) length++;
+                    distance = pos - candidate;
+                }
+            }
+            if (length >= LZ_MIN_MATCH) {
+                flushLiterals();
+                out.push_back(128 + length - LZ_MIN_MATCH);
+                out.push_back(distance & 0xFF);
+                out.push_back(distance >> 8);
+                // Index the positions inside the match too, so later rows can refer back into it
+                for (size_t p = pos + 1; p < pos + length && end - p >= LZ_MIN_MATCH; p++) {
+                    head[hash(&data[p - base])] = p;
+                }
+                pos += length;
+            } else {
+                literals[literalCount++] = at(pos++);
+                if (literalCount == 128) flushLiterals();
             }
         }
+        // Drop what fell out of the window so memory stays bounded
+        if (pos - base > 2 * LZ_WINDOW) {
+            size_t drop = pos - base - LZ_WINDOW;
+            data.erase(data.begin(), data.begin() + drop);
+            base += drop;
+        }
+    }
 
-        // Adding exit door
-        int exitX, exitY;
-        do {
-            exitX = rand() % (WIDTH - 2) + 1;
-            exitY = rand() % (HEIGHT - 2) + 1;
-        } while (grid[exitY][exitX] != nullptr || (exitX == 1 && exitY == 1));
-
-        // Adding exit door
-        exitDoor = new ExitDoor(exitX, exitY);
-        grid[exitY][exitX] = new DestructibleBlock(exitX, exitY, true);
+public:
+    explicit LzEncoder(vector<unsigned char>& out) : out(out), base(0), pos(0), literalCount(0) {
+        for (int i = 0; i < LZ_HASH_SIZE; i++) head[i] = -1;
+    }
 
+    void put(const unsigned char* bytes, size_t size) {
+        data.insert(data.end(), bytes, bytes + size);
+        encode(false);
+    }
 
-        // Initialize bombs array
-        bombCount = 0;
-        bombs = new Bomb*[NUM_BOMBS]; // Arbitrary initial size
+    void finish() {
+        encode(true);
+        flushLiterals();
     }
+};
 
-    // Function to clear the screen
-    void display() {
-        clear();
-        start_color();
-        init_pair(1, COLOR_GREEN, COLOR_BLACK);
+class LzDecoder {
+private:
+    const unsigned char* in;
+    size_t size;
+    size_t pos;
+    unsigned char history[LZ_WINDOW];   // The last LZ_WINDOW bytes produced
+    size_t produced;
+    int literalLeft;
+    int matchLeft;
+    size_t matchDistance;
 
-        for (int i = 0; i < HEIGHT; i++) {
-            for (int j = 0; j < WIDTH; j++) {
-                if (grid[i][j]) {
-                    // Check if the block is a destructible block
-                    if (auto* block = dynamic_cast<DestructibleBlock*>(grid[i][j])) {
-                        // Check if the destructible block is green
-                        // If it is green, display it in green color
-                        if (block->isGreenBlock()) {
-                            attron(COLOR_PAIR(1));
-                            mvaddch(i, j, block->getSymbol());
-                            attroff(COLOR_PAIR(1));
-                        } else {
-                            mvaddch(i, j, block->getSymbol());
-                        }
-                    } else {
-                        mvaddch(i, j, grid[i][j]->getSymbol());
-                    }
+public:
+    LzDecoder(const unsigned char* in, size_t size)
+        : in(in), size(size), pos(0), produced(0), literalLeft(0), matchLeft(0), matchDistance(0) {}
+
+    // Produce exactly n bytes; false if the input ends or is malformed
+    bool read(unsigned char* dest, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            if (literalLeft == 0 && matchLeft == 0) {
+                if (pos >= size) return false;
+                int control = in[pos++];
+                if (control < 128) {
+                    literalLeft = control + 1;
                 } else {
-                    mvaddch(i, j, ' ');
+                    if (size - pos < 2) return false;
+                    matchLeft = control - 128 + LZ_MIN_MATCH;
+                    matchDistance = in[pos] | (in[pos + 1] << 8);
+                    pos += 2;
+                    if (matchDistance == 0 || matchDistance > LZ_WINDOW || matchDistance > produced) return false;
                 }
             }
+            unsigned char byte;
+            if (literalLeft > 0) {
+                if (pos >= size) return false;
+                byte = in[pos++];
+                literalLeft--;
+            } else {
+                byte = history[(produced - matchDistance) % LZ_WINDOW];
+                matchLeft--;
+            }
+            history[produced++ % LZ_WINDOW] = byte;
+            dest[i] = byte;
         }
+        return true;
+    }
+};
 
-        // Displaying entities
-        mvaddch(player->getY(), player->getX(), player->getSymbol());
+// Reads the tile section of a save row by row, whatever its encoding
+class TileReader {
+private:
+    int flags;
+    const unsigned char* in;
+    size_t size;
+    size_t pos;
+    RleDecoder rle;
+    LzDecoder* lz;      // Allocated only for LZ saves (the history window is not small)
 
-        for (int i = 0; i < enemyCount; i++) {
-            mvaddch(enemies[i]->getY(), enemies[i]->getX(), enemies[i]->getSymbol());
-        }
+public:
+    TileReader(int flags, const unsigned char* in, size_t size)
+        : flags(flags), in(in), size(size), pos(0), rle(in, size), lz(nullptr) {
+        if (flags & SAVE_FLAG_LZ_TILES) lz = new LzDecoder(in, size);
+    }
+    ~TileReader() { delete lz; }
 
-        for (int i = 0; i < bombCount; i++) {
-            mvaddch(bombs[i]->getY(), bombs[i]->getX(), bombs[i]->getSymbol());
-        }
+    bool readRow(unsigned char* row) {
+        if (lz) return lz->read(row, WIDTH);
+        if (flags & SAVE_FLAG_RLE_TILES) return rle.read(row, WIDTH);
+        if (size - pos < WIDTH) return false;
+        memcpy(row, in + pos, WIDTH);
+        pos += WIDTH;
+        return true;
+    }
+};
 
-        if (exitDoor->isVisible()) {
-            mvaddch(exitDoor->getY(), exitDoor->getX(), exitDoor->getSymbol());
-        }
+/*
+-------------------------------------------------- Text Save Parser Class --------------------------------------------------
+*/
 
-        mvprintw(HEIGHT, 0, "Bombs planted: %d", bombsPlanted);
-        refresh();
+// Reads the text save format straight out of a buffer (the mapped file) with std::from_chars.
+// It never allocates, and the first problem it finds is kept with its line and column for the error message.
+// Numbers may be separated by any whitespace, like with ifstream >>; grid rows must be exactly WIDTH characters.
+class TextSaveParser {
+private:
+    const char* cur;
+    const char* end;
+    const char* lineStart;
+    int line;
+    const char* error;
+    int errorLine;
+    int errorColumn;
+
+    bool fail(const char* message, const char* at) {
+        if (!error) {
+            error = message;
+            errorLine = line;
+            errorColumn = at - lineStart + 1;
+        }
+        return false;
     }
 
-    // Function to check if a move is valid
-    // Enemies can step on the traps
-    // But if the player steps on it the game is over
-    bool isValidMove(int x, int y) {
-        return x > 0 && x < WIDTH - 1 && y > 0 && y < HEIGHT - 1 && grid[y][x] == nullptr || grid[y][x]->getSymbol() == TRAP;
+    void skipSpace() {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n')) {
+            if (*cur == '\n') {
+                line++;
+                lineStart = cur + 1;
+            }
+            cur++;
+        }
     }
 
-    // Function to move the player, given the change in x and y; in the game grid
-    void movePlayer(int dx, int dy) {
-        int newX = player->getX() + dx;
-        int newY = player->getY() + dy;
+public:
+    TextSaveParser(const char* data, size_t size)
+        : cur(data), end(data + size), lineStart(data), line(1), error(nullptr), errorLine(0), errorColumn(0) {}
 
-        if (isValidMove(newX, newY)) {
-            player->move(dx, dy);
-        }
+    // Read a number in [min, max]
+    bool readInt(int& value, int min, int max) {
+        skipSpace();
+        if (cur == end) return fail("unexpected end of file", cur);
+        from_chars_result result = from_chars(cur, end, value);
+        if (result.ec == errc::result_out_of_range) return fail("number is too large", cur);
+        if (result.ec != errc()) return fail("expected a number", cur);
+        if (value < min || value > max) return fail("value is out of range", cur);
+        cur = result.ptr;
+        return true;
     }
 
-    // Function to plant a bomb
-    void plantBomb() {
-        if (player->canPlantBomb()) {
-            if (bombCount >= NUM_BOMBS) {
-                return;
+    // Finish the current line; only trailing blanks may follow
+    bool endLine() {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r')) cur++;
+        if (cur == end) return true;
+        if (*cur != '\n') return fail("unexpected text at the end of the line", cur);
+        cur++;
+        line++;
+        lineStart = cur;
+        return true;
+    }
+
+    // Read one grid row; row points into the buffer and is WIDTH characters long
+    bool readRow(const char*& row) {
+        if (cur == end) return fail("missing grid row", cur);
+        const char* newline = static_cast<const char*>(memchr(cur, '\n', end - cur));
+        const char* rowEnd = newline ? newline : end;
+        size_t length = rowEnd - cur;
+        if (length > 0 && rowEnd[-1] == '\r') length--;
+        if (length < WIDTH) return fail("grid row is shorter than the board", cur + length);
+        if (length > WIDTH) return fail("grid row is longer than the board", cur + WIDTH);
+        for (int j = 0; j < WIDTH; j++) {
+            char symbol = cur[j];
+            if (symbol != ' ' && symbol != INDESTRUCTIBLE_BLOCK && symbol != DESTRUCTIBLE_BLOCK &&
+                symbol != TRAP && symbol != EXIT_DOOR) {
+                return fail("unknown tile symbol", cur + j);
             }
-            bombs[bombCount++] = new Bomb(player->getX(), player->getY());
-            player->useBomb();
-            bombsPlanted++;
         }
+        row = cur;
+        cur = newline ? newline + 1 : end;
+        line++;
+        lineStart = cur;
+        return true;
     }
 
-    // Function to explode a bomb
-    void explodeBomb(Bomb* bomb) {
-        int bx = bomb->getX(), by = bomb->getY();
-        // Explode in all 4 directions
-        for (int dx = -1; dx <= 1; dx++) {
-            for (int dy = -1; dy <= 1; dy++) {
-                if (dx == 0 || dy == 0) { // Only explode in straight lines
-                    for (int i = 1; i <= 3; i++) { // Explode up to 3 blocks away
-                        int x = bx + dx * i, y = by + dy * i;
+    const char* getError() const { return error; }
+    int getErrorLine() const { return errorLine; }
+    int getErrorColumn() const { return errorColumn; }
+};
+
+/*
+-------------------------------------------------- Save Writer Class --------------------------------------------------
+*/
+
+// Write data to path so that readers only ever see the old or the new file:
+// write a temporary file next to it, fsync it, then rename it over the old one
+static bool writeFileAtomically(const string& path, const unsigned char* data, size_t size) {
+    string tempPath = path + ".tmp";
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    size_t written = 0;
+    while (ok && written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) written += n;
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tempPath.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        unlink(tempPath.c_str());
+    }
+    return ok;
+}
+
+// Append data to the end of path and fsync it
+static bool appendFile(const string& path, const unsigned char* data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    size_t written = 0;
+    while (ok && written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) written += n;
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    return ok;
+}
+
+// One file operation of a save: replace a file atomically, or append to it
+struct FileWrite {
+    string path;
+    vector<unsigned char> data;
+    bool append;
+};
+
+// A save is a list of file operations, performed in order
+struct SaveJob {
+    vector<FileWrite> writes;
+    bool checkpoint;    // A full checkpoint makes every save of the same game queued before it redundant
+    string target;      // Checkpoint file the job belongs to
+    bool quiet = false; // Not a save (e.g. a replay or an export); left out of the save status
+    bool afterCheckpoint = false;   // Appends to the journal of the last checkpoint; failed if that checkpoint failed
+    bool tracked = false;           // Keep the outcome until the game takes it (quiet jobs have no save status)
+    unsigned long id = 0;           // Set by the writer when the job is queued
+};
+
+// Minimal io_uring submission/completion ring, driven through the raw system calls (no liburing).
+// The caller fills submission entries, submits them in one batch and reaps the completions later;
+// the kernel does the I/O on its own workers, so no thread of ours ever waits for the disk.
+class IoRing {
+private:
+    int ringFd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    void* sqMap;
+    void* cqMap;
+    size_t sqMapSize, cqMapSize, sqesSize;
+    unsigned entries;
+    unsigned queued;    // Entries filled in but not submitted yet
+
+public:
+    IoRing() : ringFd(-1), sqHead(nullptr), sqTail(nullptr), sqMask(nullptr), sqArray(nullptr), sqes(nullptr),
+               cqHead(nullptr), cqTail(nullptr), cqMask(nullptr), cqes(nullptr), sqMap(MAP_FAILED), cqMap(MAP_FAILED),
+               sqMapSize(0), cqMapSize(0), sqesSize(0), entries(0), queued(0) {}
+
+    ~IoRing() { close(); }
+
+    // Set up a ring; false if the kernel has no io_uring, it is disabled, or an operation we need is missing
+    bool open(unsigned size, const vector<int>& opcodes) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = (int)syscall(__NR_io_uring_setup, size, &params);
+        if (fd < 0) {
+            return false;
+        }
+        ringFd = fd;
+        entries = params.sq_entries;
+
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqMapSize = cqMapSize = max(sqMapSize, cqMapSize);
+        }
+        sqMap = mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqMap = singleMap ? sqMap
+                          : mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqeMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqMap == MAP_FAILED || cqMap == MAP_FAILED || sqeMap == MAP_FAILED) {
+            if (sqeMap != MAP_FAILED) munmap(sqeMap, sqesSize);
+            close();
+            return false;
+        }
+        char* sq = static_cast<char*>(sqMap);
+        char* cq = static_cast<char*>(cqMap);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes = static_cast<io_uring_sqe*>(sqeMap);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // Older kernels lack some operations (e.g. renameat before 5.11)
+        size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        vector<unsigned char> probeBuffer(probeSize, 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probeBuffer.data());
+        bool supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+        for (size_t i = 0; i < opcodes.size() && supported; i++) {
+            supported = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+        }
+        if (!supported) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (sqes) munmap(sqes, sqesSize);
+        if (cqMap != MAP_FAILED && cqMap != sqMap) munmap(cqMap, cqMapSize);
+        if (sqMap != MAP_FAILED) munmap(sqMap, sqMapSize);
+        if (ringFd >= 0) ::close(ringFd);
+        ringFd = -1;
+        sqes = nullptr;
+        sqMap = cqMap = MAP_FAILED;
+    }
+
+    bool isOpen() const { return ringFd >= 0; }
+    unsigned getEntries() const { return entries; }
+
+    // Next free submission entry, cleared; nullptr if the ring is full
+    io_uring_sqe* next() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        unsigned tail = *sqTail + queued;
+        if (tail - head >= entries) {
+            return nullptr;
+        }
+        unsigned index = tail & *sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        queued++;
+        return sqe;
+    }
+
+    // Hand the filled entries to the kernel; with wait, block until at least one completion is ready
+    bool submit(bool wait) {
+        __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+        unsigned count = queued;
+        queued = 0;
+        while (true) {
+            int n = (int)syscall(__NR_io_uring_enter, ringFd, count, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+                                 nullptr, 0);
+            if (n >= 0 || errno != EINTR) {
+                return n >= 0;
+            }
+            count = 0;
+        }
+    }
+
+    // Take the next completion, if there is one
+    bool reap(io_uring_cqe& cqe) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        cqe = cqes[head & *cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+#define IO_RING_ENTRIES 64
+#define IO_CHUNK (1 << 20)      // Large writes are split into linked writes of at most this size
+
+// Writes saves (and replays and exports) without making the game thread wait for the disk.
+// The game thread serialises into a recycled buffer and hands the job over.
+// Jobs are written in order; when a full checkpoint is queued, the jobs for the same checkpoint file
+// still waiting before it are dropped since the checkpoint already contains everything they would write.
+//
+// On Linux the writes go through io_uring: every file operation of a job becomes one linked chain of
+// writes, fsync, close and rename, submitted in a single batch, and the game thread reaps the completions
+// once per tick (poll). A failed link cancels the rest of the chain, so a temporary file is never renamed
+// over a good save. Where io_uring is not available, a background thread does the same with blocking calls.
+class SaveWriter {
+private:
+    thread worker;
+    mutable mutex lock;
+    condition_variable wake;        // Signalled when a save is queued or the writer stops
+    condition_variable idle;        // Signalled when the writer finishes a save
+    deque<SaveJob> queue;           // Jobs waiting to be written
+    vector<unsigned char> spare;    // Buffer handed back to the game thread for the next snapshot
+    bool busy;
+    bool stopping;
+    unsigned long submitted;        // Number of saves handed over
+    unsigned long finished;         // Number of saves written, failed or superseded
+    bool lastFailed;
+    bool checkpointFailed;          // Whether the most recent checkpoint written failed
+    unsigned long queued;           // Number of jobs handed over, quiet ones included; the last job's id
+    deque<pair<unsigned long, bool>> outcomes;  // Id and result of finished tracked jobs not taken yet
+
+    // io_uring backend; used from the game thread only
+    enum Backend { BACKEND_NONE, BACKEND_RING, BACKEND_THREAD };
+    Backend backend;
+    IoRing ring;
+    SaveJob current;                // Job whose chain is in flight
+    vector<string> tempPaths;       // Temporary file of each write of the current job
+    vector<int> fds;                // Open file of each write of the current job, -1 once closed
+    vector<bool> renamed;           // Whether each atomic write of the current job was renamed into place
+    int inFlight;                   // Completions still expected for the current job
+    bool currentFailed;
+
+    enum RingOp { OP_WRITE, OP_FSYNC, OP_CLOSE, OP_RENAME };
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return !queue.empty() || stopping; });
+            if (queue.empty()) {
+                break;
+            }
+            SaveJob job = move(queue.front());
+            queue.pop_front();
+            busy = true;
+            bool ok = !(job.afterCheckpoint && checkpointFailed);
+
+            guard.unlock();
+            for (size_t i = 0; i < job.writes.size() && ok; i++) {
+                const FileWrite& w = job.writes[i];
+                ok = w.append ? appendFile(w.path, w.data.data(), w.data.size())
+                              : writeFileAtomically(w.path, w.data.data(), w.data.size());
+            }
+            guard.lock();
+
+            finishJob(job, ok);
+            busy = false;
+            idle.notify_all();
+        }
+    }
+
+    // Account for a written (or failed) job and keep its buffer for the next snapshot; lock held
+    void finishJob(SaveJob& job, bool ok) {
+        if (!job.quiet) {
+            lastFailed = !ok;
+            finished++;
+        }
+        if (job.checkpoint) {
+            checkpointFailed = !ok;
+        }
+        if (job.tracked) {
+            outcomes.push_back({job.id, ok});
+        }
+        if (!job.writes.empty() && spare.capacity() < job.writes[0].data.capacity()) {
+            swap(spare, job.writes[0].data);
+        }
+    }
+
+    // Pick the backend on the first save, so games that never save never pay for it
+    void startBackend() {
+        if (backend != BACKEND_NONE) {
+            return;
+        }
+        vector<int> opcodes = {IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT};
+        if (ring.open(IO_RING_ENTRIES, opcodes)) {
+            backend = BACKEND_RING;
+        } else {
+            backend = BACKEND_THREAD;
+            worker = thread(&SaveWriter::run, this);
+        }
+    }
+
+    // Fill in a submission entry of the chain of the given write (and chunk, for writes); the entry is linked to the next one
+    io_uring_sqe* prepare(int opcode, RingOp op, int fd, size_t write, size_t chunk = 0) {
+        io_uring_sqe* sqe = ring.next();
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_ASYNC;   // Never run the I/O inline in the submitting call
+        sqe->user_data = (uint64_t)write << 32 | (uint64_t)chunk << 8 | op;
+        return sqe;
+    }
+
+    // Turn the next queued job into one linked chain and submit it; lock held
+    void startRingJob() {
+        while (inFlight == 0 && !queue.empty()) {
+            current = move(queue.front());
+            queue.pop_front();
+            if (current.afterCheckpoint && checkpointFailed) {
+                // The journal records apply to a checkpoint that never reached the disk
+                finishJob(current, false);
+                continue;
+            }
+            size_t count = current.writes.size();
+            tempPaths.assign(count, string());
+            fds.assign(count, -1);
+            renamed.assign(count, false);
+            currentFailed = false;
+
+            // Files are opened up front (a quick metadata call); everything that touches the data is queued
+            unsigned needed = 0;
+            for (size_t i = 0; i < count && !currentFailed; i++) {
+                const FileWrite& w = current.writes[i];
+                needed += (w.data.size() + IO_CHUNK - 1) / IO_CHUNK + (w.append ? 2 : 3);
+                if (w.append) {
+                    fds[i] = open(w.path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+                } else {
+                    tempPaths[i] = w.path + ".tmp";
+                    fds[i] = open(tempPaths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                }
+                currentFailed = fds[i] < 0;
+            }
+            if (currentFailed || needed > ring.getEntries()) {
+                // Too large for one batch or a file could not be opened: write this job with blocking calls
+                closeCurrent();
+                bool ok = !currentFailed;
+                for (size_t i = 0; i < count && ok; i++) {
+                    const FileWrite& w = current.writes[i];
+                    ok = w.append ? appendFile(w.path, w.data.data(), w.data.size())
+                                  : writeFileAtomically(w.path, w.data.data(), w.data.size());
+                }
+                finishJob(current, ok);
+                continue;
+            }
+
+            io_uring_sqe* last = nullptr;
+            for (size_t i = 0; i < count; i++) {
+                const FileWrite& w = current.writes[i];
+                for (size_t offset = 0; offset < w.data.size(); offset += IO_CHUNK) {
+                    io_uring_sqe* sqe = prepare(IORING_OP_WRITE, OP_WRITE, fds[i], i, offset / IO_CHUNK);
+                    sqe->addr = (uint64_t)(uintptr_t)(w.data.data() + offset);
+                    sqe->len = (unsigned)min((size_t)IO_CHUNK, w.data.size() - offset);
+                    sqe->off = w.append ? (uint64_t)-1 : offset;
+                }
+                prepare(IORING_OP_FSYNC, OP_FSYNC, fds[i], i);
+                last = prepare(IORING_OP_CLOSE, OP_CLOSE, fds[i], i);
+                if (!w.append) {
+                    last = prepare(IORING_OP_RENAMEAT, OP_RENAME, AT_FDCWD, i);
+                    last->addr = (uint64_t)(uintptr_t)tempPaths[i].c_str();
+                    last->addr2 = (uint64_t)(uintptr_t)w.path.c_str();
+                    last->len = AT_FDCWD;
+                }
+            }
+            if (last) {
+                last->flags &= ~IOSQE_IO_LINK;
+            }
+            inFlight = needed;
+            if (!ring.submit(false)) {
+                // The kernel refused the batch; nothing of it will complete
+                inFlight = 0;
+                closeCurrent();
+                finishJob(current, false);
+            }
+        }
+    }
+
+    // Close the files of the current job that its chain did not close, and drop unrenamed temporary files
+    void closeCurrent() {
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+            if (!tempPaths[i].empty() && !renamed[i]) {
+                unlink(tempPaths[i].c_str());
+            }
+        }
+    }
+
+    // Reap the completions of the current job; lock held
+    void reapRing() {
+        io_uring_cqe cqe;
+        while (inFlight > 0 && ring.reap(cqe)) {
+            size_t write = cqe.user_data >> 32;
+            size_t chunk = (cqe.user_data >> 8) & 0xFFFFFF;
+            int op = cqe.user_data & 0xFF;
+            if (cqe.res < 0) {
+                currentFailed = true;
+            } else if (op == OP_WRITE) {
+                // A short write (e.g. a full disk) leaves the file incomplete
+                size_t length = min((size_t)IO_CHUNK, current.writes[write].data.size() - chunk * IO_CHUNK);
+                currentFailed |= (size_t)cqe.res != length;
+            }
+            if (op == OP_CLOSE && cqe.res >= 0) {
+                fds[write] = -1;
+            } else if (op == OP_RENAME && cqe.res >= 0) {
+                renamed[write] = true;
+            }
+            if (--inFlight == 0) {
+                closeCurrent();
+                finishJob(current, !currentFailed);
+                idle.notify_all();
+            }
+        }
+        startRingJob();
+    }
+
+public:
+    SaveWriter() : busy(false), stopping(false), submitted(0), finished(0), lastFailed(false), checkpointFailed(false), queued(0),
+                   backend(BACKEND_NONE), inFlight(0), currentFailed(false) {}
+
+    // Destructor; writes whatever is still queued before the writer goes away
+    ~SaveWriter() {
+        if (backend == BACKEND_RING) {
+            flush();
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // Get an empty buffer to serialise the next snapshot into (keeps the capacity of earlier saves)
+    vector<unsigned char> takeBuffer() {
+        lock_guard<mutex> guard(lock);
+        vector<unsigned char> buffer;
+        swap(buffer, spare);
+        buffer.clear();
+        return buffer;
+    }
+
+    // Queue a save; returns immediately with the id of the job
+    unsigned long submit(SaveJob&& job) {
+        unsigned long id;
+        {
+            lock_guard<mutex> guard(lock);
+            startBackend();
+            if (job.checkpoint) {
+                // Superseded by the checkpoint
+                size_t kept = 0;
+                for (size_t i = 0; i < queue.size(); i++) {
+                    if (queue[i].target == job.target) {
+                        if (!queue[i].quiet) finished++;
+                    } else {
+                        if (kept != i) queue[kept] = move(queue[i]);
+                        kept++;
+                    }
+                }
+                queue.resize(kept);
+            }
+            if (!job.quiet) submitted++;
+            id = job.id = ++queued;
+            queue.push_back(move(job));
+            if (backend == BACKEND_RING) {
+                startRingJob();
+            }
+        }
+        wake.notify_one();
+        return id;
+    }
+
+    // Queue an image to replace the file at path; quiet writes are not reported in the save status,
+    // tracked ones keep their outcome for takeOutcome
+    unsigned long submit(const string& path, vector<unsigned char>&& image, bool quiet = false, bool tracked = false) {
+        SaveJob job;
+        job.writes.push_back({path, move(image), false});
+        job.checkpoint = false;
+        job.target = path;
+        job.quiet = quiet;
+        job.tracked = tracked;
+        return submit(move(job));
+    }
+
+    // Whether the tracked job with the given id is finished; if so, ok is set to whether it was written
+    bool takeOutcome(unsigned long id, bool& ok) {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < outcomes.size(); i++) {
+            if (outcomes[i].first == id) {
+                ok = outcomes[i].second;
+                outcomes.erase(outcomes.begin() + i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Reap finished writes and start the next queued job; call once per tick (does nothing for the thread backend)
+    void poll() {
+        if (backend != BACKEND_RING) {
+            return;
+        }
+        lock_guard<mutex> guard(lock);
+        reapRing();
+    }
+
+    // Block until every queued save has been written
+    void flush() {
+        if (backend == BACKEND_RING) {
+            lock_guard<mutex> guard(lock);
+            reapRing();
+            while (inFlight > 0) {
+                ring.submit(true);
+                reapRing();
+            }
+            return;
+        }
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this] { return queue.empty() && !busy; });
+    }
+
+    // Whether io_uring is used (only known once something was saved)
+    bool usesIoRing() const { return backend == BACKEND_RING; }
+
+    // Whether poll() has work to do: io_uring writes in flight or waiting to be started
+    bool needsPoll() const {
+        if (backend != BACKEND_RING) {
+            return false;
+        }
+        lock_guard<mutex> guard(lock);
+        return inFlight > 0 || !queue.empty();
+    }
+
+    // Whether a save is queued or being written
+    bool isSaving() const {
+        lock_guard<mutex> guard(lock);
+        return finished < submitted;
+    }
+
+    // Whether the most recent write failed
+    bool lastSaveFailed() const {
+        lock_guard<mutex> guard(lock);
+        return lastFailed;
+    }
+
+    // Whether the most recent checkpoint could not be written; journal appends need a new one
+    bool lastCheckpointFailed() const {
+        lock_guard<mutex> guard(lock);
+        return checkpointFailed;
+    }
+
+    // Whether any save was requested yet
+    bool hasSaved() const {
+        lock_guard<mutex> guard(lock);
+        return submitted > 0;
+    }
+};
+
+/*
+-------------------------------------------------- Journal Class --------------------------------------------------
+*/
+
+// Between two full checkpoints, saves only append the changes made since the previous save
+// to a journal file. Restoring loads the checkpoint and replays the journal on top of it.
+//
+// Journal file: JournalHeader, then records of a type byte followed by little-endian fields:
+//   JOURNAL_TILE          x u16, y u16, symbol u8      (a tile changed, e.g. a block was blown up)
+//   JOURNAL_PLAYER        x u16, y u16
+//   JOURNAL_ENEMY_MOVE    index u32, x u16, y u16, dirX i8, dirY i8
+//   JOURNAL_ENEMY_REMOVE  index u32                    (swap-removed, like Game::removeEnemy)
+//   JOURNAL_BOMB_PLANT    x u16, y u16
+//   JOURNAL_BOMB_REMOVE   index u32                    (swap-removed after exploding)
+//   JOURNAL_EXIT_VISIBLE
+// A torn record at the end (crash during an append) is ignored.
+
+#define JOURNAL_MAGIC 0x4C4A4D42    // "BMJL"
+#define JOURNAL_VERSION 1
+
+enum JournalRecord {
+    JOURNAL_TILE = 1,
+    JOURNAL_PLAYER,
+    JOURNAL_ENEMY_MOVE,
+    JOURNAL_ENEMY_REMOVE,
+    JOURNAL_BOMB_PLANT,
+    JOURNAL_BOMB_REMOVE,
+    JOURNAL_EXIT_VISIBLE
+};
+
+struct JournalHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint64_t checkpointHash;    // Hash of the checkpoint the journal applies to
+};
+
+static_assert(sizeof(JournalHeader) == 16, "JournalHeader layout changed; bump JOURNAL_VERSION");
+
+// FNV-1a hash, used to tie a journal to its checkpoint; pass the previous hash to hash several pieces
+static uint64_t hashBytes(const unsigned char* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+class Journal {
+private:
+    vector<unsigned char> pending;  // Records made since the last save
+    size_t savedBytes;              // Journal bytes already handed to the writer since the checkpoint
+    bool active;                    // Only record once there is a checkpoint to apply the records to
+
+    void put8(int value) { pending.push_back((unsigned char)value); }
+    void put16(int value) {
+        put8(value & 0xFF);
+        put8((value >> 8) & 0xFF);
+    }
+    void put32(uint32_t value) {
+        put16(value & 0xFFFF);
+        put16(value >> 16);
+    }
+
+public:
+    Journal() : savedBytes(0), active(false) {}
+
+    // Start a new journal after a checkpoint
+    void start() {
+        pending.clear();
+        savedBytes = 0;
+        active = true;
+    }
+    // Stop recording until the next checkpoint (new or loaded board)
+    void stop() {
+        pending.clear();
+        active = false;
+    }
+    bool isActive() const { return active; }
+
+    // Bytes in the journal file once the pending records are saved
+    size_t size() const { return sizeof(JournalHeader) + savedBytes + pending.size(); }
+    bool hasPending() const { return !pending.empty(); }
+
+    // Hand over the records made since the last save
+    vector<unsigned char> takePending() {
+        vector<unsigned char> records;
+        swap(records, pending);
+        savedBytes += records.size();
+        return records;
+    }
+
+    void tile(int x, int y, char symbol) {
+        if (!active) return;
+        put8(JOURNAL_TILE); put16(x); put16(y); put8(symbol);
+    }
+    void playerMove(int x, int y) {
+        if (!active) return;
+        put8(JOURNAL_PLAYER); put16(x); put16(y);
+    }
+    void enemyMove(int index, int x, int y, int dirX, int dirY) {
+        if (!active) return;
+        put8(JOURNAL_ENEMY_MOVE); put32(index); put16(x); put16(y); put8(dirX); put8(dirY);
+    }
+    void enemyRemove(int index) {
+        if (!active) return;
+        put8(JOURNAL_ENEMY_REMOVE); put32(index);
+    }
+    void bombPlant(int x, int y) {
+        if (!active) return;
+        put8(JOURNAL_BOMB_PLANT); put16(x); put16(y);
+    }
+    void bombRemove(int index) {
+        if (!active) return;
+        put8(JOURNAL_BOMB_REMOVE); put32(index);
+    }
+    void exitVisible() {
+        if (!active) return;
+        put8(JOURNAL_EXIT_VISIBLE);
+    }
+};
+
+// Reads the fields of journal records, refusing to read past the end
+class JournalReader {
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+
+public:
+    JournalReader(const unsigned char* data, size_t size) : data(data), size(size), pos(0) {}
+
+    bool atEnd() const { return pos >= size; }
+    // Whether n more bytes are available
+    bool has(size_t n) const { return size - pos >= n; }
+
+    int get8() { return data[pos++]; }
+    int getSigned8() { return (int8_t)data[pos++]; }
+    int get16() {
+        int value = data[pos] | (data[pos + 1] << 8);
+        pos += 2;
+        return value;
+    }
+    uint32_t get32() {
+        uint32_t low = get16();
+        return low | ((uint32_t)get16() << 16);
+    }
+};
+
+/*
+-------------------------------------------------- Save Index Class --------------------------------------------------
+*/
+
+// Saves live in SAVE_SLOTS slots under the save directory (slot_NN.bin plus its slot_NN.journal).
+// A small index file describes every slot, so the load menu can list them without opening any save.
+// The index is rewritten atomically together with each save.
+
+#define SAVE_SLOTS 100
+#define SLOTS_PER_PAGE 10
+#define INDEX_MAGIC 0x58494D42  // "BMIX"
+#define INDEX_VERSION 1
+
+struct SaveIndexHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slots;
+};
+
+struct SlotInfo {
+    int64_t savedAt;            // Unix time of the last save; 0 for an empty slot
+    uint16_t width, height;
+    uint32_t enemiesRemaining;
+    uint32_t bombsPlanted;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SaveIndexHeader) == 8, "SaveIndexHeader layout changed; bump INDEX_VERSION");
+static_assert(sizeof(SlotInfo) == 24, "SlotInfo layout changed; bump INDEX_VERSION");
+
+class SaveIndex {
+private:
+    SlotInfo slots[SAVE_SLOTS];
+
+public:
+    SaveIndex() { clear(); }
+
+    void clear() { memset(slots, 0, sizeof(slots)); }
+
+    // Read the index file; a missing or damaged index leaves every slot empty
+    bool load(const string& path) {
+        clear();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        unsigned char buffer[sizeof(SaveIndexHeader) + sizeof(slots)];
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        close(fd);
+        const SaveIndexHeader* header = reinterpret_cast<const SaveIndexHeader*>(buffer);
+        if (n < (ssize_t)sizeof(SaveIndexHeader) || header->magic != INDEX_MAGIC || header->version != INDEX_VERSION) {
+            return false;
+        }
+        size_t count = min((size_t)header->slots, (size_t)SAVE_SLOTS);
+        count = min(count, (n - sizeof(SaveIndexHeader)) / sizeof(SlotInfo));
+        memcpy(slots, buffer + sizeof(SaveIndexHeader), count * sizeof(SlotInfo));
+        return true;
+    }
+
+    void serialize(vector<unsigned char>& out) const {
+        SaveIndexHeader header = {INDEX_MAGIC, INDEX_VERSION, SAVE_SLOTS};
+        out.resize(sizeof(header) + sizeof(slots));
+        memcpy(out.data(), &header, sizeof(header));
+        memcpy(out.data() + sizeof(header), slots, sizeof(slots));
+    }
+
+    const SlotInfo& get(int slot) const { return slots[slot]; }
+    bool isUsed(int slot) const { return slots[slot].savedAt != 0; }
+
+    void update(int slot, int enemiesRemaining, int bombsPlanted) {
+        slots[slot].savedAt = time(nullptr);
+        slots[slot].width = WIDTH;
+        slots[slot].height = HEIGHT;
+        slots[slot].enemiesRemaining = enemiesRemaining;
+        slots[slot].bombsPlanted = bombsPlanted;
+    }
+
+    // Slot for a new game: the first empty one, or the least recently saved one when all are taken
+    int pickSlotForNewGame() const {
+        int oldest = 0;
+        for (int i = 0; i < SAVE_SLOTS; i++) {
+            if (!isUsed(i)) return i;
+            if (slots[i].savedAt < slots[oldest].savedAt) oldest = i;
+        }
+        return oldest;
+    }
+
+    // Number of slots in use
+    int usedCount() const {
+        int count = 0;
+        for (int i = 0; i < SAVE_SLOTS; i++) {
+            count += isUsed(i);
+        }
+        return count;
+    }
+};
+
+/*
+-------------------------------------------------- Level Pack Class --------------------------------------------------
+*/
+
+// A level pack holds the levels of a campaign in one file: a PackHeader, a table of contents and
+// the levels themselves, each stored as a binary save image (compressed tiles plus the enemy table).
+// The pack is mapped, not read: opening it only checks the header and the size of the table of contents,
+// and a level is decoded straight from the mapping when it is entered, so neither the start-up time
+// nor the resident memory grows with the number of levels.
+
+#define PACK_MAGIC 0x504C4D42   // "BMLP"
+#define PACK_VERSION 1
+#define PACK_NAME_LENGTH 16
+
+struct PackHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t width, height;
+    uint32_t levelCount;
+    uint32_t reserved;
+    uint64_t tocOffset;         // Offset of levelCount PackEntry records
+};
+
+struct PackEntry {
+    uint64_t offset;            // Offset of the level's save image, 8-byte aligned
+    uint64_t size;              // Size of the save image
+    char name[PACK_NAME_LENGTH];    // Shown while the level is played; not necessarily terminated
+};
+
+static_assert(sizeof(PackHeader) == 32, "PackHeader layout changed; bump PACK_VERSION");
+static_assert(sizeof(PackEntry) == 32, "PackEntry layout changed; bump PACK_VERSION");
+
+class LevelPack {
+private:
+    void* mapped;
+    size_t mappedSize;
+    const PackHeader* header;
+    const PackEntry* toc;
+    string error;
+
+public:
+    LevelPack() : mapped(MAP_FAILED), mappedSize(0), header(nullptr), toc(nullptr) {}
+    ~LevelPack() { close(); }
+
+    // Map a pack file; false (with getError() set) if it is missing or not a pack for this map size
+    bool open(const string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            error = "cannot open " + path;
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        if ((size_t)info.st_size >= sizeof(PackHeader)) {
+            mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (mapped == MAP_FAILED) {
+            error = path + " is not a level pack";
+            return false;
+        }
+        mappedSize = info.st_size;
+        header = static_cast<const PackHeader*>(mapped);
+        if (header->magic != PACK_MAGIC || header->version != PACK_VERSION || header->headerSize != sizeof(PackHeader)) {
+            error = path + " is not a level pack";
+        } else if (header->width != WIDTH || header->height != HEIGHT) {
+            error = path + " was made for a different map size";
+        } else if (header->tocOffset % 8 || header->tocOffset > mappedSize ||
+                   header->levelCount > (mappedSize - header->tocOffset) / sizeof(PackEntry)) {
+            error = path + " is damaged";
+        }
+        if (!error.empty()) {
+            close();
+            return false;
+        }
+        toc = reinterpret_cast<const PackEntry*>(static_cast<const char*>(mapped) + header->tocOffset);
+        return true;
+    }
+
+    void close() {
+        if (mapped != MAP_FAILED) {
+            munmap(mapped, mappedSize);
+        }
+        mapped = MAP_FAILED;
+        mappedSize = 0;
+        header = nullptr;
+        toc = nullptr;
+    }
+
+    bool isOpen() const { return header != nullptr; }
+    const string& getError() const { return error; }
+    int getLevelCount() const { return header ? header->levelCount : 0; }
+
+    string getLevelName(int level) const {
+        if (level < 0 || level >= getLevelCount()) return "";
+        return string(toc[level].name, strnlen(toc[level].name, PACK_NAME_LENGTH));
+    }
+
+    // The save image of a level, still inside the mapping; false if the entry points outside the file
+    bool getLevel(int level, const unsigned char*& data, size_t& size) const {
+        if (level < 0 || level >= getLevelCount()) return false;
+        const PackEntry& entry = toc[level];
+        if (entry.offset % 8 || entry.offset > mappedSize || entry.size > mappedSize - entry.offset) return false;
+        data = static_cast<const unsigned char*>(mapped) + entry.offset;
+        size = entry.size;
+        return true;
+    }
+
+    // Drop the mapped pages of the levels decoded so far (the kernel maps neighbouring pages too);
+    // they are read again from the file if a level is entered again
+    void release() {
+        if (!header) return;
+        long page = sysconf(_SC_PAGESIZE);
+        size_t end = header->tocOffset / page * page;
+        if (end > 0) {
+            madvise(mapped, end, MADV_DONTNEED);
+        }
+    }
+
+    // Write a pack from the save images of its levels
+    static bool write(const string& path, const vector<vector<unsigned char>>& levels, const vector<string>& names) {
+        vector<unsigned char> out(sizeof(PackHeader));
+        vector<PackEntry> entries(levels.size());
+        for (size_t i = 0; i < levels.size(); i++) {
+            out.resize(alignSaveOffset(out.size()));
+            entries[i] = {};
+            entries[i].offset = out.size();
+            entries[i].size = levels[i].size();
+            memcpy(entries[i].name, names[i].c_str(), min(names[i].size(), (size_t)PACK_NAME_LENGTH));
+            out.insert(out.end(), levels[i].begin(), levels[i].end());
+        }
+        out.resize(alignSaveOffset(out.size()));
+        PackHeader header = {PACK_MAGIC, PACK_VERSION, sizeof(PackHeader), WIDTH, HEIGHT,
+                             (uint32_t)levels.size(), 0, out.size()};
+        const unsigned char* tocBytes = reinterpret_cast<const unsigned char*>(entries.data());
+        out.insert(out.end(), tocBytes, tocBytes + entries.size() * sizeof(PackEntry));
+        memcpy(out.data(), &header, sizeof(header));
+        return writeFileAtomically(path, out.data(), out.size());
+    }
+};
+
+/*
+-------------------------------------------------- Connectivity Class --------------------------------------------------
+*/
+
+// Union-find over the cells of the grid, with path halving and union by rank
+class DisjointSet {
+private:
+    mutable int parent[WIDTH * HEIGHT];
+    unsigned char rank[WIDTH * HEIGHT];
+
+public:
+    // Make every cell its own set
+    void reset() {
+        for (int i = 0; i < WIDTH * HEIGHT; i++) {
+            parent[i] = i;
+            rank[i] = 0;
+        }
+    }
+
+    int find(int i) const {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    void unite(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) return;
+        if (rank[a] < rank[b]) swap(a, b);
+        parent[b] = a;
+        if (rank[a] == rank[b]) rank[a]++;
+    }
+};
+
+// Tracks which parts of the board the player can reach.
+//  - walkable:  cells the player can stand on right now (no walls, blocks or traps)
+//  - blastable: cells the player could reach by bombing its way through destructible blocks
+// Walls and traps never change, so the blastable regions are fixed once the board is built.
+// Explosions only ever open cells, which merges walkable regions, so the walkable sets are
+// updated incrementally by openCell() without flood filling the board again.
+class Connectivity {
+private:
+    DisjointSet walkable;
+    DisjointSet blastable;
+    bool open[WIDTH * HEIGHT];
+
+    static int cell(int x, int y) { return y * WIDTH + x; }
+
+    static bool inside(int x, int y) { return x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT; }
+
+public:
+    // Label the regions of a freshly generated or loaded board
+    void build(Entity*** grid) {
+        walkable.reset();
+        blastable.reset();
+        bool passable[WIDTH * HEIGHT];
+        for (int i = 0; i < HEIGHT; i++) {
+            for (int j = 0; j < WIDTH; j++) {
+                char symbol = grid[i][j] ? grid[i][j]->getSymbol() : ' ';
+                open[cell(j, i)] = symbol == ' ' || symbol == EXIT_DOOR;
+                passable[cell(j, i)] = symbol != INDESTRUCTIBLE_BLOCK && symbol != TRAP;
+            }
+        }
+        // Joining every cell with its left and upper neighbour covers all adjacent pairs
+        for (int i = 0; i < HEIGHT; i++) {
+            for (int j = 0; j < WIDTH; j++) {
+                int c = cell(j, i);
+                if (j > 0 && passable[c] && passable[c - 1]) blastable.unite(c, c - 1);
+                if (i > 0 && passable[c] && passable[c - WIDTH]) blastable.unite(c, c - WIDTH);
+                if (j > 0 && open[c] && open[c - 1]) walkable.unite(c, c - 1);
+                if (i > 0 && open[c] && open[c - WIDTH]) walkable.unite(c, c - WIDTH);
+            }
+        }
+    }
+
+    // A destructible block at (x, y) was destroyed; merge the cell with its open neighbours
+    void openCell(int x, int y) {
+        int c = cell(x, y);
+        if (open[c]) return;
+        open[c] = true;
+        static const int dx[4] = {0, 1, 0, -1}, dy[4] = {-1, 0, 1, 0};
+        for (int d = 0; d < 4; d++) {
+            int nx = x + dx[d], ny = y + dy[d];
+            if (inside(nx, ny) && open[cell(nx, ny)]) {
+                walkable.unite(c, cell(nx, ny));
+            }
+        }
+    }
+
+    // Whether the player can stand on (x, y) right now
+    bool isOpen(int x, int y) const { return inside(x, y) && open[cell(x, y)]; }
+
+    // Whether the player can walk from a to b without blasting anything
+    bool reachable(int ax, int ay, int bx, int by) const {
+        return isOpen(ax, ay) && isOpen(bx, by) && walkable.find(cell(ax, ay)) == walkable.find(cell(bx, by));
+    }
+
+    // Whether the player can get from a to b if it bombs its way through destructible blocks
+    bool reachableByBlasting(int ax, int ay, int bx, int by) const {
+        return inside(ax, ay) && inside(bx, by) && blastable.find(cell(ax, ay)) == blastable.find(cell(bx, by));
+    }
+};
+
+/*
+-------------------------------------------------- Random Number Generator Class --------------------------------------------------
+*/
+
+// Seeded xorshift64* generator. Every random choice of a game (board generation, enemy moves)
+// is drawn from the game's own generator, so a seed plus the player's inputs reproduce the game exactly.
+class Random {
+private:
+    uint64_t state;
+
+public:
+    Random(uint64_t seed = 1) { setSeed(seed); }
+
+    void setSeed(uint64_t seed) {
+        // splitmix64 spreads nearby seeds apart; the state must never be zero
+        uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        state = (z ^ (z >> 31)) | 1;
+    }
+
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1Dull;
+    }
+
+    // Uniform-enough integer in [0, n)
+    int below(int n) { return (int)(next() % (uint64_t)n); }
+
+    uint64_t getState() const { return state; }
+    // Continue from a state taken with getState() (never zero)
+    void setState(uint64_t value) { state = value; }
+};
+
+/*
+-------------------------------------------------- Free Cell Set Class --------------------------------------------------
+*/
+
+// Indexed set of free grid cells: a dense array of cells plus the position of every cell in that array.
+// Insert, remove and uniform random sampling are all O(1), so placing things on the board never
+// has to retry random positions, however crowded the board is.
+class FreeCells {
+private:
+    int cells[WIDTH * HEIGHT];      // The free cells, packed at the front
+    int position[WIDTH * HEIGHT];   // Index of each cell in cells[], or -1 if the cell is not free
+    int count;
+
+public:
+    FreeCells() { clear(); }
+
+    void clear() {
+        count = 0;
+        for (int i = 0; i < WIDTH * HEIGHT; i++) {
+            position[i] = -1;
+        }
+    }
+
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool contains(int x, int y) const { return position[y * WIDTH + x] >= 0; }
+
+    void insert(int x, int y) {
+        int c = y * WIDTH + x;
+        if (position[c] >= 0) return;
+        position[c] = count;
+        cells[count++] = c;
+    }
+
+    void remove(int x, int y) {
+        int c = y * WIDTH + x;
+        int index = position[c];
+        if (index < 0) return;
+        // Move the last cell into the hole
+        int last = cells[--count];
+        cells[index] = last;
+        position[last] = index;
+        position[c] = -1;
+    }
+
+    // Take a uniformly random free cell out of the set; the set must not be empty
+    void take(int& x, int& y, Random& random) {
+        int c = cells[random.below(count)];
+        x = c % WIDTH;
+        y = c / WIDTH;
+        remove(x, y);
+    }
+};
+
+/*
+-------------------------------------------------- Enemy Behaviours --------------------------------------------------
+*/
+
+// Everything an enemy behaviour may look at when it picks its next step.
+// The game builds it once per update and hands it to every enemy bucket.
+struct EnemyContext {
+    Entity*** grid;
+    int playerX[MAX_PLAYERS], playerY[MAX_PLAYERS]; // Player positions by slot; -1 for slots without a live player
+    Bomb** bombs;
+    int bombCount;
+    Random* random;     // The game's generator
+
+    // Same rule as Game::isValidMove; enemies can walk on empty tiles and traps
+    bool isOpen(int x, int y) const {
+        if (x <= 0 || x >= WIDTH - 1 || y <= 0 || y >= HEIGHT - 1) return false;
+        return grid[y][x] == nullptr || grid[y][x]->getSymbol() == TRAP;
+    }
+
+    // Whether a tile lies in the blast lines of any planted bomb (ignoring cover)
+    bool inBlast(int x, int y) const {
+        for (int i = 0; i < bombCount; i++) {
+            int bx = bombs[i]->getX(), by = bombs[i]->getY();
+            if ((bx == x && abs(by - y) <= 3) || (by == y && abs(bx - x) <= 3)) return true;
+        }
+        return false;
+    }
+};
+
+// The four directions in clockwise order: up, right, down, left
+static const int DIR_X[4] = {0, 1, 0, -1};
+static const int DIR_Y[4] = {-1, 0, 1, 0};
+
+// Index of a heading in DIR_X/DIR_Y
+static int directionIndex(int dx, int dy) {
+    for (int d = 0; d < 4; d++) {
+        if (DIR_X[d] == dx && DIR_Y[d] == dy) return d;
+    }
+    return 1;
+}
+
+// Each behaviour is a stateless policy with a static choose() that writes the step the enemy wants to take.
+// The game runs every archetype over its own contiguous bucket through a template,
+// so the choice is inlined and there is no switch or virtual call per enemy.
+
+struct HorizontalBehaviour {
+    static const int type = ENEMY_HORIZONTAL;
+    static void choose(Enemy&, const EnemyContext& ctx, int& dx, int& dy) {
+        dx = ctx.random->below(2) ? 1 : -1;
+        dy = 0;
+    }
+};
+
+struct VerticalBehaviour {
+    static const int type = ENEMY_VERTICAL;
+    static void choose(Enemy&, const EnemyContext& ctx, int& dx, int& dy) {
+        dx = 0;
+        dy = ctx.random->below(2) ? 1 : -1;
+    }
+};
+
+struct WandererBehaviour {
+    static const int type = ENEMY_WANDERER;
+    static void choose(Enemy&, const EnemyContext& ctx, int& dx, int& dy) {
+        int d = ctx.random->below(4);
+        dx = DIR_X[d];
+        dy = DIR_Y[d];
+    }
+};
+
+struct ChaserBehaviour {
+    static const int type = ENEMY_CHASER;
+    static void choose(Enemy& enemy, const EnemyContext& ctx, int& dx, int& dy) {
+        // Go after the nearest player (the lowest slot on a tie)
+        int distX = 0, distY = 0, nearest = INT_MAX;
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if (ctx.playerX[k] < 0) continue;
+            int x = ctx.playerX[k] - enemy.getX(), y = ctx.playerY[k] - enemy.getY();
+            if (abs(x) + abs(y) < nearest) {
+                nearest = abs(x) + abs(y);
+                distX = x;
+                distY = y;
+            }
+        }
+        int stepX = (distX > 0) - (distX < 0), stepY = (distY > 0) - (distY < 0);
+        // Close the larger gap first; if that way is blocked try the other axis
+        bool horizontalFirst = abs(distX) >= abs(distY);
+        dx = horizontalFirst ? stepX : 0;
+        dy = horizontalFirst ? 0 : stepY;
+        if ((dx || dy) && ctx.isOpen(enemy.getX() + dx, enemy.getY() + dy)) return;
+        dx = horizontalFirst ? 0 : stepX;
+        dy = horizontalFirst ? stepY : 0;
+    }
+};
+
+struct PatrollerBehaviour {
+    static const int type = ENEMY_PATROLLER;
+    static void choose(Enemy& enemy, const EnemyContext& ctx, int& dx, int& dy) {
+        dx = enemy.getDirX();
+        dy = enemy.getDirY();
+        if (!ctx.isOpen(enemy.getX() + dx, enemy.getY() + dy)) {
+            // Turn around and walk back along the same line
+            dx = -dx;
+            dy = -dy;
+            enemy.setHeading(dx, dy);
+        }
+    }
+};
+
+struct WallHuggerBehaviour {
+    static const int type = ENEMY_WALL_HUGGER;
+    static void choose(Enemy& enemy, const EnemyContext& ctx, int& dx, int& dy) {
+        // Left-hand rule: prefer turning left, then straight on, then right, then back
+        int heading = directionIndex(enemy.getDirX(), enemy.getDirY());
+        static const int turns[4] = {3, 0, 1, 2};
+        for (int t = 0; t < 4; t++) {
+            int d = (heading + turns[t]) % 4;
+            if (ctx.isOpen(enemy.getX() + DIR_X[d], enemy.getY() + DIR_Y[d])) {
+                dx = DIR_X[d];
+                dy = DIR_Y[d];
+                enemy.setHeading(dx, dy);
+                return;
+            }
+        }
+        dx = dy = 0;
+    }
+};
+
+struct BombAvoiderBehaviour {
+    static const int type = ENEMY_BOMB_AVOIDER;
+    static void choose(Enemy& enemy, const EnemyContext& ctx, int& dx, int& dy) {
+        int start = ctx.random->below(4);
+        bool threatened = ctx.inBlast(enemy.getX(), enemy.getY());
+        for (int t = 0; t < 4; t++) {
+            int d = (start + t) % 4;
+            int x = enemy.getX() + DIR_X[d], y = enemy.getY() + DIR_Y[d];
+            // Never walk into a blast line; when already in one, take the first way out
+            if (ctx.isOpen(x, y) && !ctx.inBlast(x, y)) {
+                dx = DIR_X[d];
+                dy = DIR_Y[d];
+                return;
+            }
+        }
+        // Boxed in: stay put unless standing still is deadly anyway
+        dx = threatened ? DIR_X[start] : 0;
+        dy = threatened ? DIR_Y[start] : 0;
+    }
+};
+
+/*
+-------------------------------------------------- Replay Recorder Class --------------------------------------------------
+*/
+
+// A replay is the seed of the game plus the inputs of every tick, so a whole game fits in a few kilobytes.
+// Given the same seed, the game generates the same board and draws the same enemy moves,
+// and bomb fuses burn in ticks, so feeding the inputs back on the same ticks reproduces the game exactly.
+//
+// Layout: a ReplayHeader, then a stream of records. Every record is the number of ticks since
+// the previous record (a varint, usually a single byte) followed by a one-byte tag:
+//  - an Action: the player's input on that tick
+//  - REPLAY_HASH: followed by the 8-byte state hash after that tick, to detect a diverging playback
+//  - REPLAY_QUIT / REPLAY_FINISHED: the end of the recording (quit, or the game was won or lost),
+//    followed by the state hash at that moment
+
+#define REPLAY_MAGIC 0x50524D42     // "BMRP"
+#define REPLAY_VERSION 1
+#define REPLAY_HASH_TICKS 100       // Ticks between two state hashes (5 seconds)
+#define REPLAY_BUFFER 4096          // Records are handed to the save writer in chunks of this size
+
+// The inputs that change the game state; saving and exporting are not recorded
+enum Action {
+    ACTION_NONE,
+    ACTION_UP,
+    ACTION_DOWN,
+    ACTION_LEFT,
+    ACTION_RIGHT,
+    ACTION_BOMB,
+    NUM_ACTIONS
+};
+
+enum ReplayTag {
+    REPLAY_HASH = 0x10,
+    REPLAY_QUIT = 0x20,
+    REPLAY_FINISHED = 0x21
+};
+
+struct ReplayHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t tickMs;
+    uint16_t width, height;
+    uint32_t hashInterval;
+    uint64_t seed;
+};
+
+static_assert(sizeof(ReplayHeader) == 24, "ReplayHeader layout changed; bump REPLAY_VERSION");
+
+class ReplayRecorder {
+private:
+    SaveWriter* writer;             // Writes the replay stream alongside the saves
+    string path;                    // Replay file, or empty when not recording
+    bool created;                   // Whether the first chunk (which creates the file) was handed over
+    vector<unsigned char> buffer;   // Records not written yet
+    unsigned long lastTick;         // Tick of the previous record
+
+    void put(unsigned long tick, unsigned char tag) {
+        unsigned long delta = tick - lastTick;
+        lastTick = tick;
+        while (delta >= 0x80) {
+            buffer.push_back((unsigned char)(delta | 0x80));
+            delta >>= 7;
+        }
+        buffer.push_back((unsigned char)delta);
+        buffer.push_back(tag);
+    }
+
+    // Hand the buffered records to the writer; the first chunk replaces the file, the others are appended
+    void writeBuffer() {
+        SaveJob job;
+        job.writes.push_back({path, move(buffer), created});
+        job.checkpoint = false;
+        job.target = path;
+        job.quiet = true;
+        writer->submit(move(job));
+        created = true;
+        buffer.clear();
+        buffer.reserve(REPLAY_BUFFER);
+    }
+
+public:
+    ReplayRecorder(SaveWriter* writer) : writer(writer), created(false), lastTick(0) {}
+
+    ~ReplayRecorder() {
+        if (!path.empty()) {
+            writeBuffer();
+        }
+    }
+
+    // Start a new replay file for a game generated from the given seed
+    void start(const string& file, uint64_t seed) {
+        path = file;
+        created = false;
+        ReplayHeader header = {REPLAY_MAGIC, REPLAY_VERSION, TICK_MS, WIDTH, HEIGHT, REPLAY_HASH_TICKS, seed};
+        buffer.assign((const unsigned char*)&header, (const unsigned char*)&header + sizeof(header));
+        lastTick = 0;
+    }
+
+    bool isActive() const { return !path.empty(); }
+
+    // Record the player's input on a tick
+    void input(unsigned long tick, int action) {
+        if (path.empty()) return;
+        put(tick, (unsigned char)action);
+        if (buffer.size() >= REPLAY_BUFFER) writeBuffer();
+    }
+
+    // Record the state hash after a tick
+    void hash(unsigned long tick, uint64_t value) {
+        if (path.empty()) return;
+        put(tick, REPLAY_HASH);
+        const unsigned char* bytes = (const unsigned char*)&value;
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+        if (buffer.size() >= REPLAY_BUFFER) writeBuffer();
+    }
+
+    // End the recording; finished tells whether the game was won or lost rather than quit
+    void finish(unsigned long tick, bool finished, uint64_t value) {
+        if (path.empty()) return;
+        put(tick, finished ? REPLAY_FINISHED : REPLAY_QUIT);
+        const unsigned char* bytes = (const unsigned char*)&value;
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+        writeBuffer();
+        path.clear();
+    }
+};
+
+// One record read back from a replay
+struct ReplayEvent {
+    unsigned long tick;
+    int tag;            // An Action or a ReplayTag
+    uint64_t hash;      // State hash of REPLAY_HASH, REPLAY_QUIT and REPLAY_FINISHED
+};
+
+// Reads the records of a replay straight from the mapped file
+class ReplayReader {
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    unsigned long tick;
+    ReplayHeader header;
+    string error;
+
+public:
+    ReplayReader(const unsigned char* data, size_t size) : data(data), size(size), pos(0), tick(0), header() {
+        if (size < sizeof(ReplayHeader)) {
+            error = "file is too short";
+            return;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != REPLAY_MAGIC || header.version != REPLAY_VERSION) {
+            error = "not a replay file";
+        } else if (header.width != WIDTH || header.height != HEIGHT || header.tickMs != TICK_MS) {
+            error = "recorded with a different map size or tick length";
+        }
+        pos = sizeof(header);
+    }
+
+    bool isValid() const { return error.empty(); }
+    const string& getError() const { return error; }
+    uint64_t getSeed() const { return header.seed; }
+
+    // Read the next record; false at the end of the file or on a damaged record
+    bool next(ReplayEvent& event) {
+        if (!error.empty() || pos >= size) {
+            return false;
+        }
+        unsigned long delta = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (pos >= size || shift > 56) {
+                error = "damaged record";
+                return false;
+            }
+            unsigned char b = data[pos++];
+            delta |= (unsigned long)(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        if (pos >= size) {
+            error = "damaged record";
+            return false;
+        }
+        tick += delta;
+        event.tick = tick;
+        event.tag = data[pos++];
+        event.hash = 0;
+        if (event.tag == REPLAY_HASH || event.tag == REPLAY_QUIT || event.tag == REPLAY_FINISHED) {
+            if (size - pos < sizeof(event.hash)) {
+                error = "damaged record";
+                return false;
+            }
+            memcpy(&event.hash, data + pos, sizeof(event.hash));
+            pos += sizeof(event.hash);
+        } else if (event.tag <= ACTION_NONE || event.tag >= NUM_ACTIONS) {
+            error = "unknown record";
+            return false;
+        }
+        return true;
+    }
+};
+
+/*
+-------------------------------------------------- Performance HUD --------------------------------------------------
+*/
+
+// The HUD (toggled with H) shows how long ticks, renders and inputs take, to diagnose stutter without a profiler.
+// Timings are only taken while it is shown; the allocation counter is a single relaxed increment.
+
+// Heap allocations made by the process so far, for the allocations per frame of the HUD.
+// The replacements are kept out of line so callers never see the malloc() and free() behind them.
+static atomic<unsigned long> allocationCount(0);
+// The same, counted by the calling thread only (e.g. the game server's, apart from its benchmark clients')
+static thread_local unsigned long threadAllocationCount = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    threadAllocationCount++;
+    if (void* memory = malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept { free(memory); }
+
+#define HUD_WINDOW 256  // Samples the percentiles are taken over (about 13 seconds of ticks)
+#define HUD_LINES 3     // Lines the HUD adds under the status lines
+
+// The last HUD_WINDOW samples of a measurement. One thread adds samples while another may summarize them,
+// so the slots are relaxed atomics (plain loads and stores on x86) rather than locked.
+class SampleWindow {
+private:
+    atomic<uint32_t> samples[HUD_WINDOW];
+    atomic<uint32_t> count;     // Samples added so far
+
+public:
+    SampleWindow() : count(0) {
+        for (int i = 0; i < HUD_WINDOW; i++) {
+            samples[i].store(0, memory_order_relaxed);
+        }
+    }
+
+    // Add a sample, replacing the oldest one once the window is full (single writer)
+    void add(uint32_t value) {
+        uint32_t n = count.load(memory_order_relaxed);
+        samples[n % HUD_WINDOW].store(value, memory_order_relaxed);
+        count.store(n + 1, memory_order_release);
+    }
+
+    // Median, 99th percentile and maximum of the window; false while it is empty
+    bool summarize(uint32_t& p50, uint32_t& p99, uint32_t& maximum) const {
+        uint32_t n = min<uint32_t>(count.load(memory_order_acquire), HUD_WINDOW);
+        if (n == 0) {
+            return false;
+        }
+        uint32_t sorted[HUD_WINDOW];
+        for (uint32_t i = 0; i < n; i++) {
+            sorted[i] = samples[i].load(memory_order_relaxed);
+        }
+        sort(sorted, sorted + n);
+        p50 = sorted[(n - 1) / 2];
+        p99 = sorted[(n - 1) * 99 / 100];
+        maximum = sorted[n - 1];
+        return true;
+    }
+};
+
+// Microseconds since an earlier steady clock time point, capped to fit a sample
+static uint32_t microsSince(chrono::steady_clock::time_point start) {
+    long long micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    return (uint32_t)min<long long>(max(0LL, micros), UINT32_MAX);
+}
+
+/*
+-------------------------------------------------- Renderer Classes --------------------------------------------------
+*/
+
+// The game builds what is on screen into a Frame, and a Renderer puts the frame on the terminal.
+// A frame is the part of the board in view as cells (the character with its colour pair applied,
+// like ncurses' chtype) plus the status lines under it. Every row carries the version of the board row
+// it was built from, so renderers can skip the rows they have already drawn at the same view position.
+
+#define STATUS_LINES 2
+#define STATUS_WIDTH 80
+
+#define MAX_STATUS_LINES (STATUS_LINES + HUD_LINES)
+
+struct Frame {
+    chtype rows[VIEW_MAX_HEIGHT][VIEW_MAX_WIDTH];
+    unsigned rowVersion[VIEW_MAX_HEIGHT];   // Game::getRowVersion() of the board row shown on each row
+    char status[MAX_STATUS_LINES][STATUS_WIDTH];    // Space padded, not terminated
+    int statusLines = STATUS_LINES;         // Status lines in use; the HUD adds HUD_LINES
+    bool built = false;                     // Whether every row was built at least once
+    int viewX = 0, viewY = 0;               // Board cell shown in the top left corner
+    int width = 0, height = 0;              // Size of the view in cells; the status lines follow it
+    unsigned screenVersion = 0;             // Bumped whenever the terminal was resized
+    bool measured = false;                  // Whether the HUD is shown, so the frame's render is timed
+    unsigned inputSequence = 0;             // Number of keys read before the frame was built
+    chrono::steady_clock::time_point inputTime; // When the last of them was read
+
+    // Put text on a status line, starting at the given column and cut at the end of the line
+    void print(int line, int column, const char* text) {
+        for (int i = column; i < STATUS_WIDTH && *text; i++) {
+            status[line][i] = *text++;
+        }
+    }
+
+    void clearStatus() {
+        memset(status, ' ', sizeof(status));
+    }
+};
+
+// What a frame shows, apart from the cells themselves (which follow from the view and the row versions).
+// Used to skip publishing frames that would look the same as the last one.
+struct FrameSummary {
+    int viewX = -1, viewY = -1, width = 0, height = 0, statusLines = 0;
+    unsigned screenVersion = 0;
+    unsigned inputSequence = 0;
+    unsigned rowVersion[VIEW_MAX_HEIGHT] = {};
+    char status[MAX_STATUS_LINES][STATUS_WIDTH] = {};
+
+    // Remember a frame; returns whether it differs from the one remembered before
+    bool update(const Frame& frame) {
+        if (viewX == frame.viewX && viewY == frame.viewY && width == frame.width && height == frame.height &&
+            statusLines == frame.statusLines && screenVersion == frame.screenVersion &&
+            (!frame.measured || inputSequence == frame.inputSequence) &&
+            memcmp(rowVersion, frame.rowVersion, height * sizeof(unsigned)) == 0 &&
+            memcmp(status, frame.status, statusLines * STATUS_WIDTH) == 0) {
+            return false;
+        }
+        viewX = frame.viewX;
+        viewY = frame.viewY;
+        width = frame.width;
+        height = frame.height;
+        statusLines = frame.statusLines;
+        screenVersion = frame.screenVersion;
+        inputSequence = frame.inputSequence;
+        memcpy(rowVersion, frame.rowVersion, height * sizeof(unsigned));
+        memcpy(status, frame.status, statusLines * STATUS_WIDTH);
+        return true;
+    }
+};
+
+// Colour pair used for the green block hiding the exit door
+#define PAIR_EXIT_BLOCK 1
+
+class Renderer {
+public:
+    virtual ~Renderer() {}
+
+    // Repaint the whole screen on the next draw (e.g. after a menu has drawn over the board)
+    virtual void invalidate() = 0;
+
+    // Put a frame on the terminal
+    virtual void draw(const Frame& frame) = 0;
+};
+
+// Size of the terminal; false if the output is not a terminal
+static bool terminalSize(int& rows, int& cols) {
+    winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0 || size.ws_row == 0 || size.ws_col == 0) {
+        return false;
+    }
+    rows = size.ws_row;
+    cols = size.ws_col;
+    return true;
+}
+
+// Draws through ncurses, sending every changed row with one call
+class CursesRenderer : public Renderer {
+private:
+    unsigned drawnVersion[VIEW_MAX_HEIGHT];
+    int drawnX, drawnY;             // View position the rows were drawn at
+    unsigned drawnScreen;           // Screen version the rows were drawn for
+    bool valid;
+
+public:
+    CursesRenderer() : drawnVersion(), drawnX(0), drawnY(0), drawnScreen(0), valid(false) {}
+
+    void invalidate() override { valid = false; }
+
+    void draw(const Frame& frame) override {
+        if (valid && drawnScreen != frame.screenVersion) {
+            // The terminal was resized; let ncurses know before repainting
+            int rows, cols;
+            if (terminalSize(rows, cols)) {
+                resizeterm(rows, cols);
+            }
+            valid = false;
+        }
+        if (!valid) {
+            clear();
+            start_color();
+            init_pair(PAIR_EXIT_BLOCK, COLOR_GREEN, COLOR_BLACK);
+        }
+        // After a scroll every row shows another part of the board
+        bool scrolled = drawnX != frame.viewX || drawnY != frame.viewY;
+        for (int i = 0; i < frame.height; i++) {
+            if (!valid || scrolled || drawnVersion[i] != frame.rowVersion[i]) {
+                mvaddchnstr(i, 0, frame.rows[i], frame.width);
+                drawnVersion[i] = frame.rowVersion[i];
+            }
+        }
+        // ncurses compares the status lines with the screen itself
+        for (int i = 0; i < frame.statusLines; i++) {
+            mvaddnstr(frame.height + i, 0, frame.status[i], STATUS_WIDTH);
+        }
+        drawnX = frame.viewX;
+        drawnY = frame.viewY;
+        drawnScreen = frame.screenVersion;
+        valid = true;
+        refresh();
+    }
+};
+
+// Draws with ANSI escape sequences straight to the terminal. The frame is compared cell by cell with
+// the one on screen, only the differences are written (cursor moves and colour changes included),
+// and the whole frame goes out in a single write() wrapped in a synchronized update (CSI ?2026h/l),
+// so the terminal shows it at once instead of redrawing while the bytes arrive over a slow link.
+// Input and menus still go through ncurses.
+class AnsiRenderer : public Renderer {
+private:
+    int fd;
+    chtype shown[VIEW_MAX_HEIGHT][VIEW_MAX_WIDTH];  // What the terminal shows
+    char shownStatus[MAX_STATUS_LINES][STATUS_WIDTH];
+    unsigned shownVersion[VIEW_MAX_HEIGHT];
+    int shownX, shownY;                     // View position of the rows on screen
+    int shownHeight;                        // Rows of the view on screen; the status lines are under them
+    unsigned shownScreen;                   // Screen version of what is on screen
+    bool valid;
+    string out;                             // Escape sequences of the frame, reused between frames
+    int cursorX, cursorY;                   // Where the terminal cursor is, -1 if unknown
+    chtype colour;                          // Colour pair in effect on the terminal
+
+    void moveTo(int y, int x) {
+        if (y == cursorY && x == cursorX) {
+            return;
+        }
+        char sequence[24];
+        if (y == cursorY && x > cursorX) {
+            snprintf(sequence, sizeof(sequence), "\x1b[%dC", x - cursorX);
+        } else if (cursorY >= 0 && y == cursorY + 1 && x == 0) {
+            snprintf(sequence, sizeof(sequence), "\r\n");
+        } else {
+            snprintf(sequence, sizeof(sequence), "\x1b[%d;%dH", y + 1, x + 1);
+        }
+        out += sequence;
+        cursorY = y;
+        cursorX = x;
+    }
+
+    void put(int y, int x, chtype cell) {
+        moveTo(y, x);
+        chtype pair = cell & A_COLOR;
+        if (pair != colour) {
+            out += pair == COLOR_PAIR(PAIR_EXIT_BLOCK) ? "\x1b[32m" : "\x1b[39m";
+            colour = pair;
+        }
+        out += (char)(cell & A_CHARTEXT);
+        cursorX++;
+    }
+
+public:
+    AnsiRenderer(int fd)
+        : fd(fd), shownVersion(), shownX(0), shownY(0), shownHeight(0), shownScreen(0), valid(false),
+          cursorX(-1), cursorY(-1), colour(0) {
+        out.reserve(VIEW_MAX_HEIGHT * VIEW_MAX_WIDTH * 8);
+    }
+
+    void invalidate() override { valid = false; }
+
+    void draw(const Frame& frame) override {
+        out.clear();
+        out += "\x1b[?2026h";
+        if (shownScreen != frame.screenVersion || shownHeight != frame.height) {
+            // The terminal was resized (or the status lines moved); start over
+            valid = false;
+        }
+        if (!valid) {
+            // Start from a blank screen in the default colour
+            out += "\x1b[?25l\x1b[39m\x1b[2J";
+            colour = 0;
+            cursorX = cursorY = -1;
+            for (int i = 0; i < VIEW_MAX_HEIGHT; i++) {
+                for (int j = 0; j < VIEW_MAX_WIDTH; j++) {
+                    shown[i][j] = ' ';
+                }
+            }
+            memset(shownStatus, ' ', sizeof(shownStatus));
+        }
+        // After a scroll every row is compared; only the cells that differ are written
+        bool scrolled = shownX != frame.viewX || shownY != frame.viewY;
+        for (int i = 0; i < frame.height; i++) {
+            if (valid && !scrolled && shownVersion[i] == frame.rowVersion[i]) {
+                continue;
+            }
+            shownVersion[i] = frame.rowVersion[i];
+            for (int j = 0; j < frame.width; j++) {
+                if (shown[i][j] != frame.rows[i][j]) {
+                    put(i, j, frame.rows[i][j]);
+                    shown[i][j] = frame.rows[i][j];
+                }
+            }
+        }
+        for (int i = 0; i < frame.statusLines; i++) {
+            for (int j = 0; j < STATUS_WIDTH; j++) {
+                if (shownStatus[i][j] != frame.status[i][j]) {
+                    put(frame.height + i, j, (unsigned char)frame.status[i][j]);
+                    shownStatus[i][j] = frame.status[i][j];
+                }
+            }
+        }
+        shownX = frame.viewX;
+        shownY = frame.viewY;
+        shownHeight = frame.height;
+        shownScreen = frame.screenVersion;
+        if (out.size() == strlen("\x1b[?2026h")) {
+            // Nothing changed; do not write at all
+            out.clear();
+            return;
+        }
+        out += "\x1b[?2026l";
+        valid = true;
+
+        size_t written = 0;
+        while (written < out.size()) {
+            ssize_t n = write(fd, out.data() + written, out.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // The terminal went away; repaint everything if it comes back
+                valid = false;
+                break;
+            }
+            written += n;
+        }
+    }
+
+    // Bytes written for the last frame
+    size_t lastFrameBytes() const { return out.size(); }
+};
+
+/*
+-------------------------------------------------- Render Thread Class --------------------------------------------------
+*/
+
+// Presents frames on a thread of its own, so a slow terminal (or a slow link to it) never slows the game down.
+// The game and the render thread share three frames without a lock (a triple buffer):
+//  - the game builds the next frame in its back buffer and publishes it by swapping it with the middle one
+//  - the render thread takes the middle frame, if a newer one was published, by swapping it with its front one
+// Each side only ever touches the buffer it holds, and the render thread always draws the latest frame,
+// skipping the ones it was too slow for. It sleeps on a futex while no new frame is available.
+
+#define FRAME_FRESH 4   // Set in the middle index when the middle frame has not been taken yet
+
+class RenderThread {
+private:
+    Frame frames[3];
+    int backIndex;                  // Frame the game builds into
+    int frontIndex;                 // Frame the render thread draws
+    atomic<unsigned> middle;        // Index of the third frame, plus FRAME_FRESH
+    atomic<uint32_t> published;     // Number of frames published; the render thread waits on it
+    atomic<bool> stopping;
+    Renderer* renderer;
+    thread worker;
+    SampleWindow renderTimes;       // Time taken by each draw of a measured frame (us)
+    SampleWindow inputLatency;      // Time from reading a key to drawing its first frame (us)
+    unsigned lastInput;             // Input sequence of the last measured frame drawn
+
+    // Draw a frame, timing it if the HUD is shown
+    void present(Renderer* target, const Frame& frame) {
+        if (!frame.measured) {
+            target->draw(frame);
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        target->draw(frame);
+        renderTimes.add(microsSince(start));
+        if (frame.inputSequence != lastInput) {
+            lastInput = frame.inputSequence;
+            inputLatency.add(microsSince(frame.inputTime));
+        }
+    }
+
+    // Sleep while the word holds the value (stop() bumps it too, so no timeout is needed)
+    static void futexWait(atomic<uint32_t>* word, uint32_t value) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+    }
+
+    static void futexWake(atomic<uint32_t>* word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+
+    // Swap in the latest published frame, if there is one; returns the frame to draw
+    const Frame& takeLatest() {
+        if (middle.load(memory_order_relaxed) & FRAME_FRESH) {
+            frontIndex = middle.exchange(frontIndex, memory_order_acq_rel) & ~FRAME_FRESH;
+        }
+        return frames[frontIndex];
+    }
+
+    void run() {
+        uint32_t drawn = 0;
+        while (!stopping.load(memory_order_acquire)) {
+            uint32_t latest = published.load(memory_order_acquire);
+            if (latest == drawn) {
+                futexWait(&published, latest);
+                continue;
+            }
+            drawn = latest;
+            present(renderer, takeLatest());
+        }
+    }
+
+public:
+    RenderThread()
+        : backIndex(0), frontIndex(1), middle(2), published(0), stopping(false), renderer(nullptr), lastInput(0) {}
+
+    ~RenderThread() { stop(); }
+
+    // Start presenting with the given renderer; the whole screen is repainted first
+    void start(Renderer* value) {
+        stop();
+        renderer = value;
+        renderer->invalidate();
+        stopping.store(false, memory_order_relaxed);
+        worker = thread(&RenderThread::run, this);
+    }
+
+    // Stop the render thread; afterwards the caller may use the terminal again
+    void stop() {
+        if (!worker.joinable()) {
+            return;
+        }
+        stopping.store(true, memory_order_release);
+        published.fetch_add(1, memory_order_release);
+        futexWake(&published);
+        worker.join();
+    }
+
+    bool isRunning() const { return worker.joinable(); }
+
+    // The frame the game builds next. It still holds what was built into it two frames ago,
+    // so only the rows that changed since then need to be rebuilt.
+    Frame& back() { return frames[backIndex]; }
+
+    // Hand the back frame over to the render thread; never blocks
+    void publish() {
+        backIndex = middle.exchange(backIndex | FRAME_FRESH, memory_order_acq_rel) & ~FRAME_FRESH;
+        published.fetch_add(1, memory_order_release);
+        futexWake(&published);
+    }
+
+    // Draw the latest frame on the calling thread (when the render thread is not running)
+    void drawNow(Renderer* value) {
+        present(value, takeLatest());
+    }
+
+    // Timings of the measured frames, for the HUD
+    const SampleWindow& getRenderTimes() const { return renderTimes; }
+    const SampleWindow& getInputLatency() const { return inputLatency; }
+};
+
+/*
+-------------------------------------------------- Key Input Class --------------------------------------------------
+*/
+
+// Reads keys straight from the terminal while the game is played, so the game thread makes no ncurses calls
+// while the render thread draws (ncurses is not thread safe). The terminal modes are the ones ncurses set up.
+// Arrow keys are decoded to ncurses' KEY_* codes, in both the normal and the application keypad form,
+// and a resize of the terminal is reported as KEY_RESIZE like ncurses does.
+class KeyInput {
+private:
+    int fd;
+    unsigned char buffer[64];
+    int start, end;
+
+    static volatile sig_atomic_t resized;
+    static struct sigaction previousHandler;
+    static sigset_t waitMask;       // Signal mask while waiting for a key: the usual one, with SIGWINCH let through
+
+    // SIGWINCH handler; ncurses' own handler still runs, so its menus notice the resize too
+    static void onResize(int signal) {
+        resized = 1;
+        if (!(previousHandler.sa_flags & SA_SIGINFO) && previousHandler.sa_handler != SIG_DFL &&
+            previousHandler.sa_handler != SIG_IGN) {
+            previousHandler.sa_handler(signal);
+        }
+    }
+
+public:
+    KeyInput(int fd) : fd(fd), start(0), end(0) {}
+
+    int getFd() const { return fd; }
+
+    // Start reporting terminal resizes; call once ncurses is initialised, before the game starts its threads.
+    // SIGWINCH stays blocked from then on (and in every thread started later) except inside wait(), so a
+    // resize right before the wait starts is still pending when it does and ends it at once.
+    static void watchResize() {
+        static bool watching = false;
+        if (watching) {
+            return;
+        }
+        struct sigaction action = {};
+        action.sa_handler = onResize;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &action, &previousHandler);
+        sigset_t blocked;
+        sigemptyset(&blocked);
+        sigaddset(&blocked, SIGWINCH);
+        pthread_sigmask(SIG_BLOCK, &blocked, &waitMask);
+        sigdelset(&waitMask, SIGWINCH);
+        watching = true;
+    }
+
+    // Wait for the given files like ppoll, also returning when the terminal is resized; a null timeout waits
+    // without limit. The SIGWINCH check and the wait are atomic, so a resize is never missed between them.
+    static int pollResizable(pollfd* fds, nfds_t count, const timespec* timeout) {
+        if (resized) {
+            return 0;
+        }
+        return ppoll(fds, count, timeout, &waitMask);
+    }
+
+    // Wait until a key can be read, the terminal is resized or the deadline passes
+    void wait(chrono::steady_clock::time_point deadline) {
+        if (start != end) {
+            return;
+        }
+        long long nanos = chrono::duration_cast<chrono::nanoseconds>(deadline - chrono::steady_clock::now()).count();
+        if (nanos <= 0) {
+            return;
+        }
+        timespec timeout = {(time_t)(nanos / 1000000000), (long)(nanos % 1000000000)};
+        pollfd input = {fd, POLLIN, 0};
+        pollResizable(&input, 1, &timeout);
+    }
+
+    // Next key pressed, or ERR if there is none; never blocks
+    int next() {
+        if (resized) {
+            resized = 0;
+            return KEY_RESIZE;
+        }
+        if (start == end) {
+            start = end = 0;
+            int flags = fcntl(fd, F_GETFL);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            fcntl(fd, F_SETFL, flags);
+            if (n <= 0) {
+                return ERR;
+            }
+            end = n;
+        }
+        unsigned char c = buffer[start++];
+        if (c == 27 && end - start >= 2 && (buffer[start] == '[' || buffer[start] == 'O')) {
+            unsigned char code = buffer[start + 1];
+            const char* arrows = "ABCD";
+            const int keys[] = {KEY_UP, KEY_DOWN, KEY_RIGHT, KEY_LEFT};
+            for (int i = 0; i < 4; i++) {
+                if (code == (unsigned char)arrows[i]) {
+                    start += 2;
+                    return keys[i];
+                }
+            }
+        }
+        return c;
+    }
+};
+
+volatile sig_atomic_t KeyInput::resized = 0;
+struct sigaction KeyInput::previousHandler;
+sigset_t KeyInput::waitMask;
+
+/*
+-------------------------------------------------- Session Recording Classes --------------------------------------------------
+*/
+
+// A session recording holds the frames that were on screen, for archiving matches and watching them back.
+// Only the cells that changed since the previous frame are stored, with a full keyframe every
+// SESSION_KEYFRAME_TICKS ticks (and whenever the size of the screen changes), so a player can seek
+// to any moment by decoding the keyframe before it and at most a keyframe interval of changes.
+//
+// The screen is recorded as rows x cols cells: the board rows of the view, then the status lines,
+// cols being the wider of the two. A cell is one byte (its character), or 0x80 | colour pair then the character.
+//
+// Layout: a SessionHeader, then records, then (once the recording is finished) the keyframe index.
+// Every record is a one-byte tag and the 32-bit size of its payload, so records can be skipped without decoding:
+//  - SESSION_KEYFRAME: varint tick, u16 board width, u16 board height, u8 status lines, then the whole screen
+//    as runs of identical cells (varint length, cell)
+//  - SESSION_DELTA: varint ticks since the previous record, then the changed cells as
+//    (varint cells skipped, varint cells changed, the changed cells) spans in row-major order
+// The index is a SessionIndexEntry per keyframe followed by a SessionTrailer at the very end of the file.
+// A recording cut short (e.g. the game crashed) has no index; the player then finds the keyframes
+// by skipping from record to record.
+
+#define SESSION_MAGIC 0x53534D42        // "BMSS"
+#define SESSION_VERSION 1
+#define SESSION_KEYFRAME_TICKS 200      // Ticks between two keyframes (10 seconds)
+#define SESSION_BUFFER 16384            // Records are handed to the save writer in chunks of this size
+
+enum SessionTag {
+    SESSION_KEYFRAME = 'K',
+    SESSION_DELTA = 'D'
+};
+
+struct SessionHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t tickMs;
+    uint32_t keyframeTicks;
+    uint32_t reserved;
+};
+
+struct SessionIndexEntry {
+    uint64_t tick;
+    uint64_t offset;    // File offset of the keyframe record
+};
+
+struct SessionTrailer {
+    uint64_t indexOffset;
+    uint32_t count;
+    uint32_t magic;
+};
+
+static_assert(sizeof(SessionHeader) == 16, "SessionHeader layout changed; bump SESSION_VERSION");
+static_assert(sizeof(SessionIndexEntry) == 16 && sizeof(SessionTrailer) == 16,
+              "Session index layout changed; bump SESSION_VERSION");
+
+// Cell of a recorded screen: the character, with the colour pair in the high byte
+static uint16_t sessionCell(chtype cell) {
+    return (uint16_t)((cell & 0x7F) | (PAIR_NUMBER(cell) << 8));
+}
+
+static void putVarint(vector<unsigned char>& out, unsigned long value) {
+    while (value >= 0x80) {
+        out.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((unsigned char)value);
+}
+
+static void putSessionCell(vector<unsigned char>& out, uint16_t cell) {
+    if (cell >> 8) {
+        out.push_back((unsigned char)(0x80 | (cell >> 8)));
+    }
+    out.push_back((unsigned char)(cell & 0x7F));
+}
+
+class SessionRecorder {
+private:
+    SaveWriter* writer;             // Writes the recording alongside the saves
+    string path;                    // Recording file, or empty when not recording
+    bool created;                   // Whether the first chunk (which creates the file) was handed over
+    vector<unsigned char> buffer;   // Records not written yet
+    uint64_t bufferOffset;          // File offset of the start of the buffer
+    vector<SessionIndexEntry> index;
+    vector<uint16_t> screen;        // The last recorded screen
+    vector<uint16_t> next;          // The screen being recorded
+    int width, height, statusLines, cols;
+    unsigned long lastTick;         // Tick of the previous record (frames without changes have none)
+    unsigned long lastKeyframe;     // Tick of the last keyframe
+
+    // Hand the buffered records to the writer; the first chunk replaces the file, the others are appended
+    void writeBuffer() {
+        SaveJob job;
+        bufferOffset += buffer.size();
+        job.writes.push_back({path, move(buffer), created});
+        job.checkpoint = false;
+        job.target = path;
+        job.quiet = true;
+        writer->submit(move(job));
+        created = true;
+        buffer.clear();
+        buffer.reserve(SESSION_BUFFER);
+    }
+
+    // Start a record; its size is filled in by endRecord
+    size_t beginRecord(unsigned char tag) {
+        buffer.push_back(tag);
+        buffer.resize(buffer.size() + sizeof(uint32_t));
+        return buffer.size();
+    }
+
+    void endRecord(size_t payloadStart) {
+        uint32_t size = buffer.size() - payloadStart;
+        memcpy(buffer.data() + payloadStart - sizeof(size), &size, sizeof(size));
+        if (buffer.size() >= SESSION_BUFFER) {
+            writeBuffer();
+        }
+    }
+
+    void writeKeyframe(unsigned long tick) {
+        index.push_back({tick, bufferOffset + buffer.size()});
+        size_t start = beginRecord(SESSION_KEYFRAME);
+        putVarint(buffer, tick);
+        uint16_t sizes[2] = {(uint16_t)width, (uint16_t)height};
+        buffer.insert(buffer.end(), (const unsigned char*)sizes, (const unsigned char*)(sizes + 2));
+        buffer.push_back((unsigned char)statusLines);
+        for (size_t i = 0; i < next.size(); ) {
+            size_t run = 1;
+            while (i + run < next.size() && next[i + run] == next[i]) run++;
+            putVarint(buffer, run);
+            putSessionCell(buffer, next[i]);
+            i += run;
+        }
+        endRecord(start);
+        lastKeyframe = lastTick = tick;
+    }
+
+    // Write the cells that changed since the last recorded screen; nothing if none did
+    void writeDelta(unsigned long tick) {
+        size_t start = 0;
+        size_t last = 0;        // End of the previous span
+        for (size_t i = 0; i < next.size(); ) {
+            if (next[i] == screen[i]) {
+                i++;
+                continue;
+            }
+            size_t end = i + 1;
+            while (end < next.size() && next[end] != screen[end]) end++;
+            if (!start) {
+                start = beginRecord(SESSION_DELTA);
+                putVarint(buffer, tick - lastTick);
+            }
+            putVarint(buffer, i - last);
+            putVarint(buffer, end - i);
+            for (size_t j = i; j < end; j++) {
+                putSessionCell(buffer, next[j]);
+            }
+            last = i = end;
+        }
+        if (start) {
+            endRecord(start);
+            lastTick = tick;
+        }
+    }
+
+public:
+    SessionRecorder(SaveWriter* writer)
+        : writer(writer), created(false), bufferOffset(0), width(0), height(0), statusLines(0), cols(0),
+          lastTick(0), lastKeyframe(0) {}
+
+    ~SessionRecorder() { finish(); }
+
+    // Start a new recording
+    void start(const string& file) {
+        path = file;
+        created = false;
+        SessionHeader header = {SESSION_MAGIC, SESSION_VERSION, TICK_MS, SESSION_KEYFRAME_TICKS, 0};
+        buffer.assign((const unsigned char*)&header, (const unsigned char*)&header + sizeof(header));
+        bufferOffset = 0;
+        index.clear();
+        screen.clear();
+        width = height = statusLines = cols = 0;
+    }
+
+    bool isActive() const { return !path.empty(); }
+
+    // Record the frame on screen at a tick
+    void record(unsigned long tick, const Frame& frame) {
+        if (path.empty()) return;
+        bool resized = frame.width != width || frame.height != height || frame.statusLines != statusLines;
+        width = frame.width;
+        height = frame.height;
+        statusLines = frame.statusLines;
+        cols = max(width, STATUS_WIDTH);
+        next.assign((size_t)(height + statusLines) * cols, ' ');
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                next[(size_t)i * cols + j] = sessionCell(frame.rows[i][j]);
+            }
+        }
+        for (int i = 0; i < statusLines; i++) {
+            for (int j = 0; j < STATUS_WIDTH; j++) {
+                next[(size_t)(height + i) * cols + j] = (unsigned char)frame.status[i][j] & 0x7F;
+            }
+        }
+        if (screen.empty() || resized || tick - lastKeyframe >= SESSION_KEYFRAME_TICKS) {
+            writeKeyframe(tick);
+        } else {
+            writeDelta(tick);
+        }
+        screen.swap(next);
+    }
+
+    // End the recording: write the keyframe index and hand over what is left
+    void finish() {
+        if (path.empty()) return;
+        SessionTrailer trailer = {bufferOffset + buffer.size(), (uint32_t)index.size(), SESSION_MAGIC};
+        buffer.insert(buffer.end(), (const unsigned char*)index.data(), (const unsigned char*)(index.data() + index.size()));
+        buffer.insert(buffer.end(), (const unsigned char*)&trailer, (const unsigned char*)(&trailer + 1));
+        writeBuffer();
+        path.clear();
+    }
+};
+
+// Plays a session recording back from the mapped file: seeks through the keyframe index,
+// then applies the records one by one
+class SessionReader {
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t end;                     // End of the records (start of the index, if any)
+    size_t pos;                     // Next record
+    vector<SessionIndexEntry> index;
+    vector<uint16_t> screen;
+    int width, height, statusLines, cols;
+    unsigned long tick;
+    string error;
+
+    bool getVarint(size_t& at, size_t limit, unsigned long& value) {
+        value = 0;
+        for (int shift = 0; at < limit && shift <= 56; shift += 7) {
+            unsigned char b = data[at++];
+            value |= (unsigned long)(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool getCell(size_t& at, size_t limit, uint16_t& cell) {
+        if (at >= limit) return false;
+        cell = data[at++];
+        if (cell & 0x80) {
+            if (at >= limit) return false;
+            cell = (uint16_t)(((cell & 0x7F) << 8) | data[at++]);
+        }
+        return true;
+    }
+
+    // Size of the record at an offset; false if it does not fit in the records
+    bool recordAt(size_t at, unsigned char& tag, size_t& payload, size_t& payloadEnd) const {
+        uint32_t length;
+        if (end - at < 1 + sizeof(length)) return false;
+        tag = data[at];
+        memcpy(&length, data + at + 1, sizeof(length));
+        payload = at + 1 + sizeof(length);
+        if (end - payload < length) return false;
+        payloadEnd = payload + length;
+        return true;
+    }
+
+    // Tick of the keyframe at an offset, without decoding it
+    bool keyframeTick(size_t at, unsigned long& value) {
+        unsigned char tag;
+        size_t payload, payloadEnd;
+        return recordAt(at, tag, payload, payloadEnd) && tag == SESSION_KEYFRAME &&
+               getVarint(payload, payloadEnd, value);
+    }
+
+    bool fail(const char* message) {
+        error = message;
+        return false;
+    }
+
+public:
+    SessionReader(const unsigned char* data, size_t size)
+        : data(data), size(size), end(size), pos(sizeof(SessionHeader)), width(0), height(0), statusLines(0),
+          cols(0), tick(0) {
+        SessionHeader header;
+        if (size < sizeof(header)) {
+            error = "file is too short";
+            return;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != SESSION_MAGIC || header.version != SESSION_VERSION || header.tickMs != TICK_MS) {
+            error = "not a session recording";
+            return;
+        }
+        SessionTrailer trailer;
+        if (size >= sizeof(header) + sizeof(trailer)) {
+            memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+            uint64_t indexBytes = (uint64_t)trailer.count * sizeof(SessionIndexEntry);
+            // Compared without sums, so a damaged offset cannot wrap around into range
+            if (trailer.magic == SESSION_MAGIC && trailer.indexOffset >= sizeof(header) &&
+                trailer.indexOffset <= size - sizeof(trailer) &&
+                indexBytes == size - sizeof(trailer) - trailer.indexOffset) {
+                index.resize(trailer.count);
+                memcpy(index.data(), data + trailer.indexOffset, indexBytes);
+                end = trailer.indexOffset;
+                return;
+            }
+        }
+        // No index (the recording was cut short): find the keyframes by skipping over the records
+        for (size_t at = pos; at < end; ) {
+            unsigned char tag;
+            size_t payload, payloadEnd;
+            if (!recordAt(at, tag, payload, payloadEnd)) {
+                end = at;       // Drop the incomplete record at the end
+                break;
+            }
+            unsigned long keyTick;
+            if (tag == SESSION_KEYFRAME && keyframeTick(at, keyTick)) {
+                index.push_back({keyTick, at});
+            }
+            at = payloadEnd;
+        }
+    }
+
+    bool isValid() const { return error.empty(); }
+    const string& getError() const { return error; }
+
+    unsigned long getTick() const { return tick; }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getStatusLines() const { return statusLines; }
+    uint16_t getCell(int row, int col) const { return screen[(size_t)row * cols + col]; }
+
+    // Tick of the first keyframe, where the recording starts
+    unsigned long firstTick() const { return index.empty() ? 0 : index.front().tick; }
+
+    // Apply the next record; false at the end of the recording or on a damaged record
+    bool next() {
+        unsigned char tag;
+        size_t at, payloadEnd;
+        if (!error.empty() || pos >= end) {
+            return false;
+        }
+        if (!recordAt(pos, tag, at, payloadEnd)) {
+            return fail("damaged record");
+        }
+        unsigned long value;
+        if (!getVarint(at, payloadEnd, value)) {
+            return fail("damaged record");
+        }
+        if (tag == SESSION_KEYFRAME) {
+            uint16_t sizes[2];
+            if (payloadEnd - at < sizeof(sizes) + 1) return fail("damaged record");
+            memcpy(sizes, data + at, sizeof(sizes));
+            at += sizeof(sizes);
+            width = sizes[0];
+            height = sizes[1];
+            statusLines = data[at++];
+            if (width > VIEW_MAX_WIDTH || height > VIEW_MAX_HEIGHT || statusLines > MAX_STATUS_LINES) {
+                return fail("recorded on a larger screen");
+            }
+            cols = max(width, STATUS_WIDTH);
+            screen.assign((size_t)(height + statusLines) * cols, ' ');
+            for (size_t i = 0; i < screen.size(); ) {
+                unsigned long run;
+                uint16_t cell;
+                if (!getVarint(at, payloadEnd, run) || !getCell(at, payloadEnd, cell) || run > screen.size() - i) {
+                    return fail("damaged record");
+                }
+                fill(screen.begin() + i, screen.begin() + i + run, cell);
+                i += run;
+            }
+            tick = value;
+        } else if (tag == SESSION_DELTA) {
+            if (screen.empty()) return fail("change before the first keyframe");
+            size_t i = 0;
+            while (at < payloadEnd) {
+                unsigned long skip, count;
+                if (!getVarint(at, payloadEnd, skip) || !getVarint(at, payloadEnd, count) ||
+                    skip > screen.size() - i || count > screen.size() - i - skip) {
+                    return fail("damaged record");
+                }
+                i += skip;
+                for (unsigned long k = 0; k < count; k++) {
+                    if (!getCell(at, payloadEnd, screen[i++])) return fail("damaged record");
+                }
+            }
+            tick += value;
+        }
+        // Unknown records are skipped, so newer recorders can add some
+        pos = payloadEnd;
+        return true;
+    }
+
+    // Tick of the next record, without applying it; false at the end
+    bool peekTick(unsigned long& value) {
+        unsigned char tag;
+        size_t at, payloadEnd;
+        if (!error.empty() || pos >= end || !recordAt(pos, tag, at, payloadEnd) || !getVarint(at, payloadEnd, value)) {
+            return false;
+        }
+        if (tag != SESSION_KEYFRAME) {
+            value += tick;
+        }
+        return true;
+    }
+
+    // Show the screen as it was at a tick: decode the last keyframe at or before it
+    // and the changes after it up to the tick. Returns the number of records decoded.
+    int seek(unsigned long target) {
+        if (!error.empty() || index.empty()) {
+            return 0;
+        }
+        auto it = upper_bound(index.begin(), index.end(), target,
+                              [](unsigned long t, const SessionIndexEntry& e) { return t < e.tick; });
+        pos = it == index.begin() ? index.front().offset : (it - 1)->offset;
+        int decoded = 0;
+        unsigned long upcoming;
+        do {
+            if (!next()) break;
+            decoded++;
+        } while (peekTick(upcoming) && upcoming <= target);
+        return decoded;
+    }
+};
+
+/*
+-------------------------------------------------- Network Protocol --------------------------------------------------
+*/
+
+// A network game is hosted by a server that owns the only real Game (--serve): every client sends
+// the actions of its player and draws the states the server sends after each tick (--connect).
+//
+// The TCP stream is cut into messages, each a NetHeader (payload size and type) followed by the payload;
+// integers are little-endian, as written by the host. Both ends read and write through fixed-size
+// ring buffers allocated with the connection, so no message allocates anything on the way in or out.
+//
+// A state only holds what changed since the last state the client acknowledged (see Game::writeDelta),
+// so a quiet board costs a few bytes per tick whatever its size. The server starts over with the whole
+// game whenever the client has nothing it can build on: when it joins, and on every new game or level.
+
+#define NET_PORT 7777               // Default port of --serve and --connect
+#define NET_INPUT_RING 4096         // Buffer of the small messages clients send
+#define NET_STATE_RING (2 * WIDTH * HEIGHT + 65536) // Buffer of the states, with room for a whole crowded board
+#define NET_MAX_INPUT 64            // Largest message a client may send
+#define NET_INPUT_QUEUE 16          // Actions the server holds per player; one is applied per tick
+#define NET_VARINT_BITS 4           // Value bits in each group of a varint; a fifth bit says whether another follows
+#define NET_TILE_BITS 3             // Bits of a tile code (NetTile)
+#define NET_ROLLBACK_TICKS 10       // Ticks a client predicts ahead of the last state from the server
+
+enum NetMessageType {
+    NET_INPUT = 1,  // Client: NetInput, an action of its player
+    NET_PING,       // Client: NetPing, answered straight away with NET_PONG (to measure latency)
+    NET_PONG,       // Server: the NetPing it answers
+    NET_WELCOME,    // Server: NetWelcome, once the client has joined
+    NET_STATE,      // Server: after every tick, the bit-packed changes since the state the client acknowledged
+    NET_END,        // Server: the game is over; the payload is the result, and a new game follows
+    NET_FULL,       // Server: every player slot is taken; the connection is closed
+    NET_ACK         // Client: NetAck, the last state it applied
+};
+
+// Tiles in a state
+enum NetTile {
+    NET_TILE_EMPTY,
+    NET_TILE_INDESTRUCTIBLE,
+    NET_TILE_DESTRUCTIBLE,
+    NET_TILE_GREEN,         // The destructible block hiding the exit door
+    NET_TILE_TRAP,
+    NET_TILE_EXIT           // An exit door that sits in the grid (e.g. restored from a save)
+};
+
+struct NetHeader {
+    uint32_t size;      // Payload bytes after the header
+    uint16_t type;      // NetMessageType
+    uint16_t reserved;
+};
+
+struct NetInput {
+    uint32_t sequence;  // Counts the inputs of the client; states tell which one was applied last
+    uint32_t action;    // Action
+};
+
+struct NetPing {
+    uint64_t sentNanos; // Sender's clock, echoed back unchanged
+};
+
+struct NetWelcome {
+    uint32_t slot;      // Player slot of the client
+    uint16_t width, height;
+};
+
+struct NetAck {
+    uint32_t epoch;     // Epoch and tick of the state, as the state gave them
+    uint32_t tick;
+};
+
+// An action of the local player that the client sent but the server has not acknowledged yet
+struct PredictedInput {
+    uint32_t sequence;      // As sent in the NetInput
+    int action;
+    unsigned long tick;     // Tick the prediction applies it on, before that tick's update
+};
+
+static_assert(sizeof(NetHeader) == 8 && sizeof(NetInput) == 8 && sizeof(NetPing) == 8, "Network message layout changed");
+static_assert(sizeof(NetWelcome) == 8 && sizeof(NetAck) == 8, "Network message layout changed");
+
+// Writes values of any bit width one after the other, least significant bit first, into a byte buffer
+// that is reused from message to message
+class BitWriter {
+private:
+    vector<unsigned char>& out;
+    uint64_t pending;   // Bits not yet written out, in the low pendingBits bits
+    int pendingBits;
+
+public:
+    explicit BitWriter(vector<unsigned char>& out) : out(out), pending(0), pendingBits(0) { out.clear(); }
+
+    // Append the low bits of a value (at most 32 bits at a time)
+    void put(uint32_t value, int bits) {
+        pending |= (uint64_t)(value & (uint32_t)((1ull << bits) - 1)) << pendingBits;
+        pendingBits += bits;
+        while (pendingBits >= 8) {
+            out.push_back((unsigned char)pending);
+            pending >>= 8;
+            pendingBits -= 8;
+        }
+    }
+
+    // Append a value in groups of NET_VARINT_BITS, so small numbers (most positions and gaps) take few bits
+    void putVarint(uint64_t value) {
+        do {
+            uint32_t group = value & ((1u << NET_VARINT_BITS) - 1);
+            value >>= NET_VARINT_BITS;
+            put(group | (value ? 1u << NET_VARINT_BITS : 0), NET_VARINT_BITS + 1);
+        } while (value);
+    }
+
+    // Write out the last partial byte
+    void finish() {
+        if (pendingBits > 0) {
+            out.push_back((unsigned char)pending);
+        }
+        pending = 0;
+        pendingBits = 0;
+    }
+};
+
+// Reads what a BitWriter wrote. Reading past the end yields zeros and marks the reader as failed,
+// so a damaged message can be decoded to the end and rejected once.
+class BitReader {
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t position;    // Bits read so far
+    bool failed;
+
+public:
+    BitReader(const unsigned char* data, size_t size) : data(data), size(size), position(0), failed(false) {}
+
+    bool hasFailed() const { return failed; }
+
+    uint32_t get(int bits) {
+        if (position + bits > size * 8) {
+            failed = true;
+            position = size * 8;
+            return 0;
+        }
+        uint32_t value = 0;
+        for (int got = 0; got < bits;) {
+            int offset = position % 8;
+            int take = min(8 - offset, bits - got);
+            value |= (uint32_t)((data[position / 8] >> offset) & ((1u << take) - 1)) << got;
+            got += take;
+            position += take;
+        }
+        return value;
+    }
+
+    uint64_t getVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += NET_VARINT_BITS) {
+            uint32_t group = get(NET_VARINT_BITS + 1);
+            value |= (uint64_t)(group & ((1u << NET_VARINT_BITS) - 1)) << shift;
+            if (!(group >> NET_VARINT_BITS)) {
+                return value;
+            }
+        }
+        failed = true;
+        return 0;
+    }
+};
+
+// Nanoseconds on the steady clock, for the timestamps of pings
+static uint64_t steadyNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Fixed-size byte queue over a single allocation. The socket reads into it and writes out of it with
+// one readv/writev of up to two spans, so data that wraps around the end needs no extra copy or call.
+class ByteRing {
+private:
+    unique_ptr<unsigned char[]> data;
+    size_t capacity;
+    size_t head, tail;      // Bytes taken out and put in so far; the ring holds tail - head bytes
+
+    // Up to two spans of the ring starting at a position, covering length bytes
+    int spans(size_t position, size_t length, iovec* iov) const {
+        size_t start = position % capacity;
+        size_t first = min(length, capacity - start);
+        iov[0] = {data.get() + start, first};
+        iov[1] = {data.get(), length - first};
+        return length == first ? 1 : 2;
+    }
+
+public:
+    explicit ByteRing(size_t capacity) : data(new unsigned char[capacity]), capacity(capacity), head(0), tail(0) {}
+
+    size_t size() const { return tail - head; }
+    size_t space() const { return capacity - size(); }
+    void clear() { head = tail = 0; }
+
+    // Append bytes; nothing is written (false) unless all of them fit
+    bool write(const void* bytes, size_t length) {
+        if (length > space()) return false;
+        iovec iov[2];
+        int count = spans(tail, length, iov);
+        const unsigned char* from = static_cast<const unsigned char*>(bytes);
+        for (int i = 0; i < count; i++) {
+            memcpy(iov[i].iov_base, from, iov[i].iov_len);
+            from += iov[i].iov_len;
+        }
+        tail += length;
+        return true;
+    }
+
+    // Copy bytes from an offset into the queued data without taking them out
+    void peek(size_t offset, void* bytes, size_t length) const {
+        iovec iov[2];
+        int count = spans(head + offset, length, iov);
+        unsigned char* to = static_cast<unsigned char*>(bytes);
+        for (int i = 0; i < count; i++) {
+            memcpy(to, iov[i].iov_base, iov[i].iov_len);
+            to += iov[i].iov_len;
+        }
+    }
+
+    // The free space, to read into, and the queued bytes, to write out
+    int freeSpans(iovec* iov) const { return spans(tail, space(), iov); }
+    int usedSpans(iovec* iov) const { return spans(head, size(), iov); }
+
+    // Account for bytes read into the free space, or taken out of the queued data
+    void produced(size_t length) { tail += length; }
+    void consume(size_t length) { head += length; }
+};
+
+// One end of a game connection: the socket, and the rings its messages go through
+class NetConnection {
+private:
+    int fd;
+    ByteRing in, out;
+    bool broken;        // The peer sent something that is not a message of the protocol
+
+public:
+    NetConnection(size_t inSize, size_t outSize) : fd(-1), in(inSize), out(outSize), broken(false) {}
+    ~NetConnection() { close(); }
+
+    bool isOpen() const { return fd >= 0; }
+    int getFd() const { return fd; }
+    bool isBroken() const { return broken; }
+    // Whether messages are waiting for the socket to take them
+    bool hasPending() const { return out.size() > 0; }
+
+    // Take over a connected socket (made non-blocking, with Nagle's algorithm off so small messages go out at once)
+    void attach(int socketFd) {
+        close();
+        fd = socketFd;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        in.clear();
+        out.clear();
+        broken = false;
+    }
+
+    // Connect to a server; false if it cannot be reached
+    bool connectTo(const string& host, int port) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses;
+        if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &addresses) != 0) {
+            return false;
+        }
+        int socketFd = -1;
+        for (addrinfo* a = addresses; a && socketFd < 0; a = a->ai_next) {
+            socketFd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+            if (socketFd >= 0 && connect(socketFd, a->ai_addr, a->ai_addrlen) != 0) {
+                ::close(socketFd);
+                socketFd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (socketFd < 0) {
+            return false;
+        }
+        attach(socketFd);
+        return true;
+    }
+
+    // Queue a message made of a header and the given parts; nothing is queued (false) unless all of it fits
+    bool send(int type, const iovec* parts, int count) {
+        NetHeader header = {0, (uint16_t)type, 0};
+        for (int i = 0; i < count; i++) header.size += parts[i].iov_len;
+        if (sizeof(header) + header.size > out.space()) {
+            return false;
+        }
+        out.write(&header, sizeof(header));
+        for (int i = 0; i < count; i++) out.write(parts[i].iov_base, parts[i].iov_len);
+        return true;
+    }
+
+    bool send(int type, const void* payload, size_t size) {
+        iovec part = {const_cast<void*>(payload), size};
+        return send(type, &part, 1);
+    }
+
+    // Write out as much as the socket takes; false if the connection is gone
+    bool flush() {
+        while (out.size() > 0) {
+            iovec iov[2];
+            msghdr message = {};
+            message.msg_iov = iov;
+            message.msg_iovlen = out.usedSpans(iov);
+            ssize_t written = sendmsg(fd, &message, MSG_NOSIGNAL);
+            if (written < 0) {
+                return errno == EAGAIN || errno == EINTR;
+            }
+            out.consume(written);
+        }
+        return true;
+    }
+
+    // Read everything the socket has; false once the peer has closed the connection
+    bool receive() {
+        while (in.space() > 0) {
+            iovec iov[2];
+            int count = in.freeSpans(iov);
+            ssize_t received = readv(fd, iov, count);
+            if (received == 0) {
+                return false;
+            }
+            if (received < 0) {
+                return errno == EAGAIN || errno == EINTR;
+            }
+            in.produced(received);
+        }
+        return true;
+    }
+
+    // Take the next complete message, copying its payload (at most capacity bytes) to payload.
+    // False if no complete message has arrived yet, or if the next one is too large, which breaks the connection.
+    bool next(NetHeader& header, unsigned char* payload, size_t capacity) {
+        if (broken || in.size() < sizeof(header)) {
+            return false;
+        }
+        in.peek(0, &header, sizeof(header));
+        if (header.size > capacity) {
+            broken = true;
+            return false;
+        }
+        if (in.size() < sizeof(header) + header.size) {
+            return false;
+        }
+        in.peek(sizeof(header), payload, header.size);
+        in.consume(sizeof(header) + header.size);
+        return true;
+    }
+};
+
+/*
+-------------------------------------------------- Game Class --------------------------------------------------
+*/
+
+class Game {
+private:
+    string saveFileName = "game_save.txt";          // Text export
+    string binarySaveFileName = "game_save.bin";    // Binary save (full checkpoint), loaded with mmap
+    string journalFileName = "game_save.journal";   // Changes made since the checkpoint
+    string saveDirectory = "saves";                 // Directory of the save slots and their index
+    int currentSlot = -1;                           // Save slot in use; -1 for the single legacy save files
+    SaveIndex saveIndex;                            // Metadata of every save slot
+    bool saveDirectoryReady = false;                // Whether the save directory was created
+    int saveCompression = SAVE_FLAG_RLE_TILES;      // Encoding of the tile section of checkpoints
+    size_t lastTileBytes = 0;                       // Tile section size of the last checkpoint
+    long lastSerializeMicros = 0;                   // Time taken to build the last checkpoint
+    string loadError;                               // Why the last load failed, if the save was damaged
+    
+    Entity*** grid;     // 2D array of Entity pointers
+    Player* players[MAX_PLAYERS] = {};  // Players by slot; slot 0 is the local player, the others join network games
+    Enemy** enemies;    // Array of pointers to enemy objects
+    int enemyCount;     // Number of enemies
+    int enemyCapacity;  // Allocated size of the enemies array
+
+    // Enemy movement scheduler: a timing wheel per archetype.
+    // schedule[t][s] holds the enemies of type t that move on the ticks where tick % SCHEDULE_SLOTS == s,
+    // so an update only visits the enemies that are due instead of the whole population.
+    vector<Enemy*> schedule[NUM_ENEMY_TYPES][SCHEDULE_SLOTS];
+    unsigned long tick;         // Number of updates since the game started
+    unsigned long staggered;    // Number of enemies scheduled so far, used to spread first moves over the period
+    unsigned playersCaught;     // Bit k is set when an enemy and the player in slot k end up on the same tile
+
+    // Both are sized by the board, so they live on the heap and a board handoff swaps the pointers
+    unique_ptr<Connectivity> connectivity;  // Regions of the board the player can reach
+    unique_ptr<FreeCells> freeCells;        // Empty cells while a board is being generated
+
+    SaveWriter saveWriter;      // Writes saves on a background thread
+    Journal journal;            // Changes since the last full checkpoint
+    size_t checkpointSize;      // Size of the last full checkpoint
+    Bomb** bombs;       // Array of pointers to bomb objects
+    int bombCount;      // Number of bombs
+    ExitDoor* exitDoor; // Pointer to the exit door object
+    int bombsPlanted;   // Number of bombs planted by the player
+
+    // Every row has a version number that is bumped whenever something in that row changes;
+    // consumers (e.g. the observation encoder) remember the versions they have seen
+    // and only re-read the rows that moved on since then
+    unsigned rowVersion[HEIGHT] = {};
+
+    // Called once per tick after the game state is updated (e.g. to publish observations)
+    function<void(const Game&)> tickListener;
+
+    uint64_t seed;              // Seed the board was generated from
+    Random random;              // Source of every random choice of the game
+    ReplayRecorder replay;      // Records the inputs of the game when a replay file is given
+    string replayFileName;      // Where to record new games; empty to not record
+    SessionRecorder session;    // Records the frames on screen when a session file is given
+    string sessionFileName;     // Where to record the screen; empty to not record
+    bool headless = false;      // Run without the terminal; the end of the game is reported instead of shown
+    bool finished = false;      // Set when a headless game is won or lost
+    bool predicted = false;     // Runs ahead of a server's game (a network client); the server decides how boards end
+    string result;              // How a headless game ended
+    uint64_t finishHash = 0;    // State hash at the moment a headless game ended
+
+    LevelPack* levelPack = nullptr; // Authored levels played instead of random boards, if given
+    int currentLevel = 0;           // Level being played, counted from 0
+
+    // The next level is built on a worker thread while the current one is played
+    thread preloader;               // Builds the next level
+    Game* nextBoard = nullptr;      // The next level, once the preloader is done
+    Game* retiredBoard = nullptr;   // The previous level, deleted by the preloader
+    long lastHandoffMicros = -1;    // Time taken to swap in the last level
+    long maxHandoffMicros = 0;      // Longest handoff so far
+
+    // Terminal output and input
+    RenderThread presenter;         // Draws the frames the game publishes
+    CursesRenderer cursesRenderer;
+    Renderer* renderer = &cursesRenderer;
+    KeyInput keyInput{STDIN_FILENO};
+    string notice;                  // Message shown under the board, e.g. after an export
+    unsigned long noticeUntil = 0;  // Tick at which the notice goes away
+    unsigned long exportJob = 0;    // Save writer job of an export still being written, 0 if none
+
+    // Camera: the part of the board on screen, sized to the terminal and following the player
+    int viewX = 0, viewY = 0;       // Board cell in the top left corner of the view
+    int viewWidth = VIEW_MAX_WIDTH, viewHeight = VIEW_MAX_HEIGHT;
+    unsigned screenVersion = 0;     // Bumped when the terminal is resized
+
+    FrameSummary published;         // What the last published frame showed
+    int localSlot = 0;              // Player this terminal plays; other slots are network players
+    unsigned onlineSlots = 0;       // Bit k is set while a client plays slot k of a network game (0 offline)
+    unsigned long keyTick = ULONG_MAX;  // Tick the last key was handled on (one key per tick)
+
+    // Performance HUD; nothing is measured while it is hidden
+    bool hudVisible = false;
+    SampleWindow tickTimes;             // Time spent on each tick, sleep excluded (us)
+    SampleWindow tickAllocations;       // Heap allocations made during each tick
+    SampleWindow rollbackTimes;         // Time taken by each rollback of a network game's prediction (us)
+    unsigned inputSequence = 0;         // Keys read so far (the key that shows the HUD is the first one measured)
+    chrono::steady_clock::time_point inputTime; // When the last of them was read
+
+    // Spatial index of the enemies: enemyChunks[c] lists the enemies inside chunk c, a CHUNK_SIZE square
+    // of the board (row-major), so drawing the view only visits the enemies near it
+    vector<Enemy*> enemyChunks[CHUNK_ROWS * CHUNK_COLS];
+
+    // Network replication: the tick of the first state that shows each change, so a server can send a client
+    // only what changed after the last state it acknowledged. Entities carry their own stamp; what is gone
+    // is logged by id.
+    vector<uint32_t> tileChanges;           // Per cell (allocated on the first change)
+    uint32_t rowChanges[HEIGHT] = {};       // Latest tile change in each row, so unchanged rows are skipped
+    uint32_t randomChanged = 0;             // Latest change of the generator state
+    uint32_t bombsChanged = 0;              // Latest bomb planted or gone off
+    vector<pair<uint32_t, uint32_t>> enemyRemovals; // Id and tick of every enemy killed on this board, in order
+    uint32_t forgottenTick = 0;             // Changes up to this tick may be missing from the log
+    uint32_t nextBombId = 0;
+    vector<Enemy*> enemiesById;             // On a client: the enemies by the ids the server gave them
+    vector<pair<uint32_t, uint32_t>> removalsReceived;  // On a client: the enemy removals of the state being applied
+    uint32_t stateEpoch = 0;                // On a client: epoch of the last state applied
+
+    // Tick of the first state that shows a change made now. Updates count the tick up half way through,
+    // so the changes made after that are stamped one tick late, which at worst sends them twice.
+    uint32_t changeTick() const { return tick + 1; }
+
+    // Mark a tile as changed
+    void stampTile(int x, int y) {
+        if (tileChanges.empty()) tileChanges.assign(WIDTH * HEIGHT, 0);
+        tileChanges[y * WIDTH + x] = rowChanges[y] = changeTick();
+    }
+
+    // Forget every change so far (a new board, which shows from the state of this tick on); states before it
+    // can no longer be built on
+    void forgetChanges() {
+        enemyRemovals.clear();
+        forgottenTick = tick;
+    }
+
+    // Mark a row as changed
+    void touchRow(int y) {
+        if (y >= 0 && y < HEIGHT) rowVersion[y]++;
+    }
+    // Mark every row as changed (new or loaded board)
+    void touchAllRows() {
+        for (int i = 0; i < HEIGHT; i++) rowVersion[i]++;
+    }
+
+    // Allocate an empty enemies array that can hold up to capacity enemies
+    void resetEnemies(int capacity) {
+        enemies = new Enemy*[capacity > 0 ? capacity : 1];
+        enemyCapacity = capacity;
+        enemyCount = 0;
+        for (int t = 0; t < NUM_ENEMY_TYPES; t++) {
+            for (int s = 0; s < SCHEDULE_SLOTS; s++) {
+                schedule[t][s].clear();
+            }
+        }
+        staggered = 0;
+        for (int c = 0; c < CHUNK_ROWS * CHUNK_COLS; c++) {
+            enemyChunks[c].clear();
+        }
+    }
+
+    // Spatial index chunk of a board cell
+    static int chunkOf(int x, int y) {
+        return y / CHUNK_SIZE * CHUNK_COLS + x / CHUNK_SIZE;
+    }
+
+    // List an enemy in the chunk of its position
+    void indexEnemy(Enemy* enemy) {
+        int chunk = chunkOf(enemy->getX(), enemy->getY());
+        enemy->setChunk(chunk, enemyChunks[chunk].size());
+        enemyChunks[chunk].push_back(enemy);
+    }
+
+    // Take an enemy out of its chunk (the last enemy of the chunk takes its place)
+    void unindexEnemy(Enemy* enemy) {
+        vector<Enemy*>& list = enemyChunks[enemy->getChunk()];
+        Enemy* last = list.back();
+        list[enemy->getChunkIndex()] = last;
+        last->setChunk(enemy->getChunk(), enemy->getChunkIndex());
+        list.pop_back();
+        enemy->setChunk(-1, 0);
+    }
+
+    // Move an enemy, keeping the spatial index up to date
+    void moveEnemy(Enemy* enemy, int dx, int dy) {
+        enemy->move(dx, dy);
+        if (chunkOf(enemy->getX(), enemy->getY()) != enemy->getChunk()) {
+            unindexEnemy(enemy);
+            indexEnemy(enemy);
+        }
+    }
+
+    // Put an enemy in the scheduler slot of the tick it moves next
+    void scheduleEnemy(Enemy* enemy, unsigned long moveTick) {
+        vector<Enemy*>& slot = schedule[enemy->getMoveType()][moveTick % SCHEDULE_SLOTS];
+        enemy->setSlot(moveTick % SCHEDULE_SLOTS, slot.size());
+        slot.push_back(enemy);
+    }
+
+    // Take an enemy out of its scheduler slot
+    void unscheduleEnemy(Enemy* enemy) {
+        if (enemy->getSlot() < 0) {
+            return;
+        }
+        vector<Enemy*>& slot = schedule[enemy->getMoveType()][enemy->getSlot()];
+        Enemy* last = slot.back();
+        slot[enemy->getSlotIndex()] = last;
+        last->setSlot(enemy->getSlot(), enemy->getSlotIndex());
+        slot.pop_back();
+        enemy->setSlot(-1, 0);
+    }
+
+    // List an enemy in the roster and its chunk without scheduling it; the roster must have room
+    void listEnemy(Enemy* enemy) {
+        enemy->setRosterIndex(enemyCount);
+        enemies[enemyCount++] = enemy;
+        indexEnemy(enemy);
+    }
+
+    // Add an enemy and schedule its first move; first moves are staggered over the period to spread the load
+    void addEnemy(Enemy* enemy) {
+        if (enemyCount >= enemyCapacity) {
+            delete enemy;
+            return;
+        }
+        enemy->setId(enemyCount);
+        listEnemy(enemy);
+        int period = ENEMY_MOVE_PERIOD[enemy->getMoveType()];
+        scheduleEnemy(enemy, tick + 1 + staggered++ % period);
+    }
+
+    // Delete the enemy at the given index
+    void removeEnemy(int index) {
+        journal.enemyRemove(index);
+        enemyRemovals.push_back({(uint32_t)enemies[index]->getId(), changeTick()});
+        if ((size_t)enemies[index]->getId() < enemiesById.size()) {
+            enemiesById[enemies[index]->getId()] = nullptr;
+        }
+        unscheduleEnemy(enemies[index]);
+        unindexEnemy(enemies[index]);
+        delete enemies[index];
+        enemies[index] = enemies[--enemyCount];
+        if (index < enemyCount) {
+            enemies[index]->setRosterIndex(index);
+        }
+    }
+
+    // Put a bomb on the board under a new id
+    void addBomb(Bomb* bomb) {
+        bomb->setId(nextBombId++);
+        bomb->setChangedTick(changeTick());
+        bombs[bombCount++] = bomb;
+        bombsChanged = changeTick();
+    }
+
+    // Delete the bomb at the given index
+    void removeBomb(int index) {
+        journal.bombRemove(index);
+        bombsChanged = changeTick();
+        delete bombs[index];
+        bombs[index] = bombs[--bombCount];
+    }
+
+    // Move the enemies of one archetype that are due this tick; specialised per behaviour
+    // so the hot loop has no type dispatch
+    template <class Behaviour>
+    void updateBucket(const EnemyContext& ctx) {
+        vector<Enemy*>& due = schedule[Behaviour::type][tick % SCHEDULE_SLOTS];
+        unsigned long nextTick = tick + ENEMY_MOVE_PERIOD[Behaviour::type];
+        for (size_t i = 0; i < due.size(); i++) {
+            Enemy* enemy = due[i];
+            int dx = 0, dy = 0;
+            int dirX = enemy->getDirX(), dirY = enemy->getDirY();
+            Behaviour::choose(*enemy, ctx, dx, dy);
+            // Only move if the new position is valid
+            bool moved = (dx || dy) && isValidMove(enemy->getX() + dx, enemy->getY() + dy);
+            if (moved) {
+                touchRow(enemy->getY());
+                moveEnemy(enemy, dx, dy);
+                touchRow(enemy->getY());
+                for (int k = 0; k < MAX_PLAYERS; k++) {
+                    if (enemy->getX() == ctx.playerX[k] && enemy->getY() == ctx.playerY[k]) {
+                        playersCaught |= 1u << k;
+                    }
+                }
+            }
+            if (moved || dirX != enemy->getDirX() || dirY != enemy->getDirY()) {
+                enemy->setChangedTick(changeTick());
+                journal.enemyMove(enemy->getRosterIndex(), enemy->getX(), enemy->getY(), enemy->getDirX(), enemy->getDirY());
+            }
+            // The period is shorter than the wheel, so the next slot is never the one being walked
+            scheduleEnemy(enemy, nextTick);
+        }
+        due.clear();
+    }
+
+    // Function to clear the screen and display the menu
+    void displayMenu() {
+        clear();
+        mvprintw(LINES / 2 - 2, COLS / 2 - 10, "1. Start a new game");
+        mvprintw(LINES / 2 - 1, COLS / 2 - 10, "2. Load previous game");
+        mvprintw(LINES / 2, COLS / 2 - 10, "3. Exit");
+        refresh();
+    }
+
+    // Path of the save slot index
+    string indexPath() const {
+        return saveDirectory + "/index.bin";
+    }
+
+    // Make the saves go to a slot (-1 for the legacy game_save.bin / game_save.journal files)
+    void selectSlot(int slot) {
+        currentSlot = slot;
+        if (slot < 0) {
+            binarySaveFileName = "game_save.bin";
+            journalFileName = "game_save.journal";
+        } else {
+            char name[32];
+            snprintf(name, sizeof(name), "/slot_%02d", slot);
+            binarySaveFileName = saveDirectory + name + ".bin";
+            journalFileName = saveDirectory + name + ".journal";
+        }
+        // The first save to the new files has to be a full checkpoint
+        journal.stop();
+    }
+
+    // Function to list the save slots from the index and let the player pick one.
+    // Returns the chosen slot, -1 for the legacy save files, or -2 to go back.
+    int displaySlotBrowser() {
+        saveIndex.load(indexPath());
+        int used[SAVE_SLOTS];
+        int usedCount = 0;
+        for (int i = 0; i < SAVE_SLOTS; i++) {
+            if (saveIndex.isUsed(i)) used[usedCount++] = i;
+        }
+        int pages = max(1, (usedCount + SLOTS_PER_PAGE - 1) / SLOTS_PER_PAGE);
+        int page = 0;
+        while (true) {
+            clear();
+            mvprintw(1, 2, "Saved games: %d (page %d of %d)", usedCount, page + 1, pages);
+            int shown = min(SLOTS_PER_PAGE, usedCount - page * SLOTS_PER_PAGE);
+            for (int k = 0; k < shown; k++) {
+                int slot = used[page * SLOTS_PER_PAGE + k];
+                const SlotInfo& info = saveIndex.get(slot);
+                time_t savedAt = info.savedAt;
+                char when[32];
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&savedAt));
+                mvprintw(3 + k, 2, "%d. Slot %2d  %s  %ux%u  enemies left: %u  bombs planted: %u",
+                         k, slot, when, info.width, info.height, info.enemiesRemaining, info.bombsPlanted);
+            }
+            mvprintw(4 + SLOTS_PER_PAGE, 2, "0-9: load   n/p: next/previous page   l: legacy save file   q: back");
+            refresh();
+
+            int ch = getch();
+            if (ch >= '0' && ch < '0' + shown) {
+                return used[page * SLOTS_PER_PAGE + ch - '0'];
+            } else if (ch == 'n' && page + 1 < pages) {
+                page++;
+            } else if (ch == 'p' && page > 0) {
+                page--;
+            } else if (ch == 'l') {
+                return -1;
+            } else if (ch == 'q') {
+                return -2;
+            }
+        }
+    }
+
+    // Function to export the game state to a text file
+    void exportGame() {
+        // The text is built in memory and written by the save writer; runTick reports the outcome
+        ostringstream saveFile;
+        // Save player position
+        saveFile << players[0]->getX() << " " << players[0]->getY() << "\n";
+
+        // Save bombs planted
+        saveFile << bombsPlanted << "\n";
+
+        // Save enemy positions
+        saveFile << enemyCount << "\n";
+        for (int i = 0; i < enemyCount; i++) {
+            saveFile << enemies[i]->getX() << " " << enemies[i]->getY() << " " << enemies[i]->getMoveType() << "\n";
+        }
+
+        // Save bomb positions
+        saveFile << bombCount << "\n";
+        for (int i = 0; i < bombCount; i++) {
+            saveFile << bombs[i]->getX() << " " << bombs[i]->getY() << "\n";
+        }
+
+        // Save exit door position
+        saveFile << exitDoor->getX() << " " << exitDoor->getY() << " " << exitDoor->isVisible() << "\n";
+
+        // Save grid state
+        for (int i = 0; i < HEIGHT; i++) {
+            for (int j = 0; j < WIDTH; j++) {
+                if (grid[i][j]) {
+                    saveFile << grid[i][j]->getSymbol();
+                } else {
+                    saveFile << ' ';
+                }
+            }
+            saveFile << "\n";
+        }
+
+        string text = saveFile.str();
+        exportJob = saveWriter.submit(saveFileName, vector<unsigned char>(text.begin(), text.end()), true, true);
+    }
+
+    // Delete the grid, enemies and bombs before a saved game replaces them
+    void clearState() {
+        clearGrid();
+        for (int i = 0; i < enemyCount; i++) {
+            delete enemies[i];
+        }
+        delete[] enemies;
+        for (int i = 0; i < bombCount; i++) {
+            delete bombs[i];
+        }
+        delete[] bombs;
+    }
+
+    // Create the grid tile for a saved symbol
+    void placeTile(int x, int y, char symbol) {
+        switch (symbol) {
+            case INDESTRUCTIBLE_BLOCK:
+                grid[y][x] = new IndestructibleBlock(x, y);
+                break;
+            case DESTRUCTIBLE_BLOCK:
+                grid[y][x] = new DestructibleBlock(x, y);
+                break;
+            case TRAP:
+                grid[y][x] = new Trap(x, y);
+                break;
+            case EXIT_DOOR:
+                grid[y][x] = exitDoor; // Place the exit door in the grid
+                break;
+        }
+    }
+
+    // Write the game state in the binary save format; returns the size of the (compressed) tile section
+    size_t serialize(vector<unsigned char>& out) const {
+        SaveHeader header = {};
+        header.magic = SAVE_MAGIC;
+        header.version = SAVE_VERSION;
+        header.headerSize = sizeof(SaveHeader);
+        header.width = WIDTH;
+        header.height = HEIGHT;
+        header.playerX = players[0]->getX();
+        header.playerY = players[0]->getY();
+        header.bombsPlanted = bombsPlanted;
+        header.enemyCount = enemyCount;
+        header.bombCount = bombCount;
+        header.exitX = exitDoor->getX();
+        header.exitY = exitDoor->getY();
+        header.exitVisible = exitDoor->isVisible();
+        header.flags = saveCompression;
+        header.tilesOffset = sizeof(SaveHeader);
+
+        // Tiles are streamed row by row, straight into the encoder when compressing
+        out.assign(sizeof(SaveHeader), 0);
+        RleEncoder rle(out);
+        LzEncoder* lz = saveCompression & SAVE_FLAG_LZ_TILES ? new LzEncoder(out) : nullptr;
+        unsigned char row[WIDTH];
+        for (int i = 0; i < HEIGHT; i++) {
+            for (int j = 0; j < WIDTH; j++) {
+                row[j] = grid[i][j] ? grid[i][j]->getSymbol() : ' ';
+            }
+            if (lz) {
+                lz->put(row, WIDTH);
+            } else if (saveCompression & SAVE_FLAG_RLE_TILES) {
+                rle.put(row, WIDTH);
+            } else {
+                out.insert(out.end(), row, row + WIDTH);
+            }
+        }
+        if (lz) {
+            lz->finish();
+            delete lz;
+        } else if (saveCompression & SAVE_FLAG_RLE_TILES) {
+            rle.finish();
+        }
+        size_t tileBytes = out.size() - header.tilesOffset;
+
+        header.enemiesOffset = alignSaveOffset(out.size());
+        header.bombsOffset = alignSaveOffset(header.enemiesOffset + enemyCount * sizeof(SaveEnemy));
+        header.fileSize = header.bombsOffset + bombCount * sizeof(SaveBomb);
+        out.resize(header.fileSize, 0);
+        memcpy(out.data(), &header, sizeof(header));
+
+        SaveEnemy* savedEnemies = reinterpret_cast<SaveEnemy*>(out.data() + header.enemiesOffset);
+        for (int i = 0; i < enemyCount; i++) {
+            savedEnemies[i] = {enemies[i]->getX(), enemies[i]->getY(), enemies[i]->getMoveType(),
+                               (int8_t)enemies[i]->getDirX(), (int8_t)enemies[i]->getDirY(), 0};
+        }
+        SaveBomb* savedBombs = reinterpret_cast<SaveBomb*>(out.data() + header.bombsOffset);
+        for (int i = 0; i < bombCount; i++) {
+            savedBombs[i] = {bombs[i]->getX(), bombs[i]->getY(), bombs[i]->fuseRemainingMs(), (uint32_t)bombs[i]->getOwner()};
+        }
+        return tileBytes;
+    }
+
+    // Replace the game state with a binary save image; returns false (leaving the game untouched)
+    // if the image is not a valid save for this board size
+    bool restore(const unsigned char* data, size_t size) {
+        // Validate the layout in place
+        if (size < sizeof(SaveHeader)) return false;
+        const SaveHeader* header = reinterpret_cast<const SaveHeader*>(data);
+        if (header->magic != SAVE_MAGIC || header->version < 1 || header->version > SAVE_VERSION ||
+            header->headerSize != sizeof(SaveHeader) ||
+            header->width != WIDTH || header->height != HEIGHT || header->fileSize != size ||
+            (header->flags & ~(SAVE_FLAG_RLE_TILES | SAVE_FLAG_LZ_TILES)) ||
+            header->enemyCount > WIDTH * HEIGHT || header->bombCount > MAX_BOMBS ||
+            header->tilesOffset < sizeof(SaveHeader) || header->tilesOffset > header->enemiesOffset ||
+            header->enemiesOffset % 8 || header->enemiesOffset > size ||
+            header->enemyCount > (size - header->enemiesOffset) / sizeof(SaveEnemy) ||
+            header->bombsOffset % 8 || header->bombsOffset > size ||
+            header->bombCount > (size - header->bombsOffset) / sizeof(SaveBomb)) {
+            return false;
+        }
+        auto inside = [](int x, int y) { return x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT; };
+        const unsigned char* tiles = data + header->tilesOffset;
+        size_t tileBytes = header->enemiesOffset - header->tilesOffset;
+        unsigned char row[WIDTH];
+        if (header->flags) {
+            // A compressed tile section has to be decoded once to know it is complete
+            TileReader check(header->flags, tiles, tileBytes);
+            for (int i = 0; i < HEIGHT; i++) {
+                if (!check.readRow(row)) return false;
+            }
+        } else if (tileBytes < WIDTH * HEIGHT) {
+            return false;
+        }
+        const SaveEnemy* savedEnemies = reinterpret_cast<const SaveEnemy*>(data + header->enemiesOffset);
+        const SaveBomb* savedBombs = reinterpret_cast<const SaveBomb*>(data + header->bombsOffset);
+        if (!inside(header->playerX, header->playerY) || !inside(header->exitX, header->exitY)) return false;
+        for (uint32_t i = 0; i < header->enemyCount; i++) {
+            if (!inside(savedEnemies[i].x, savedEnemies[i].y)) return false;
+        }
+        for (uint32_t i = 0; i < header->bombCount; i++) {
+            if (!inside(savedBombs[i].x, savedBombs[i].y)) return false;
+        }
+
+        // Rebuild the game straight from the mapped tables
+        clearState();
+        journal.stop();
+        delete players[0];
+        players[0] = new Player(header->playerX, header->playerY);
+        playersCaught = 0;
+        bombsPlanted = header->bombsPlanted;
+
+        resetEnemies(header->enemyCount);
+        for (uint32_t i = 0; i < header->enemyCount; i++) {
+            const SaveEnemy& saved = savedEnemies[i];
+            Enemy* enemy = new Enemy(saved.x, saved.y, saved.type);
+            enemy->setHeading(saved.dirX, saved.dirY);
+            addEnemy(enemy);
+            if (saved.x == header->playerX && saved.y == header->playerY) {
+                playersCaught |= 1;
+            }
+        }
+
+        bombCount = 0;
+        bombs = new Bomb*[MAX_BOMBS];
+        for (uint32_t i = 0; i < header->bombCount; i++) {
+            int owner = savedBombs[i].owner < MAX_PLAYERS ? savedBombs[i].owner : 0;
+            addBomb(new Bomb(savedBombs[i].x, savedBombs[i].y, max(0, min(3000, (int)savedBombs[i].fuseMs)), owner));
+            if (players[owner]) players[owner]->useBomb();
+        }
+
+        delete exitDoor;
+        exitDoor = new ExitDoor(header->exitX, header->exitY);
+        exitDoor->setVisible(header->exitVisible);
+
+        TileReader reader(header->flags, tiles, tileBytes);
+        for (int i = 0; i < HEIGHT; i++) {
+            reader.readRow(row);
+            for (int j = 0; j < WIDTH; j++) {
+                placeTile(j, i, row[j]);
+            }
+        }
+        // Make the green brick on the exit door, if it is not visible
+        if (!exitDoor->isVisible()) {
+            delete grid[header->exitY][header->exitX];
+            grid[header->exitY][header->exitX] = new DestructibleBlock(header->exitX, header->exitY, true);
+        }
+
+        connectivity->build(grid);
+        touchAllRows();
+        return true;
+    }
+
+    // Function to save the game state.
+    // Most saves only append the journal records made since the previous save. A full checkpoint is
+    // written for the first save of a board and whenever the journal has grown to half the checkpoint
+    // size; it replaces the binary save and starts an empty journal, which compacts the journal away.
+    // The game thread only builds the bytes; the background writer does the file I/O. Appends queued
+    // behind a checkpoint are only written once that checkpoint is on disk; if it failed, they fail too
+    // and the next save writes a new checkpoint.
+    void saveGame() {
+        if (journal.isActive() && journal.size() < checkpointSize / 2 && !saveWriter.lastCheckpointFailed()) {
+            if (journal.hasPending()) {
+                SaveJob job;
+                job.writes.push_back({journalFileName, journal.takePending(), true});
+                addIndexWrite(job);
+                job.checkpoint = false;
+                job.afterCheckpoint = true;
+                job.target = binarySaveFileName;
+                saveWriter.submit(move(job));
+            }
+            return;
+        }
+
+        // Full checkpoint: snapshot into a recycled buffer, written to a temporary file and renamed into place
+        vector<unsigned char> image = saveWriter.takeBuffer();
+        auto start = chrono::steady_clock::now();
+        lastTileBytes = serialize(image);
+        lastSerializeMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        checkpointSize = image.size();
+        JournalHeader header = {JOURNAL_MAGIC, JOURNAL_VERSION, 0, hashBytes(image.data(), image.size())};
+        vector<unsigned char> emptyJournal(sizeof(header));
+        memcpy(emptyJournal.data(), &header, sizeof(header));
+
+        SaveJob job;
+        job.writes.push_back({binarySaveFileName, move(image), false});
+        job.writes.push_back({journalFileName, move(emptyJournal), false});
+        addIndexWrite(job);
+        job.checkpoint = true;
+        job.target = binarySaveFileName;
+        saveWriter.submit(move(job));
+        journal.start();
+    }
+
+    // When saving to a slot, update its index entry and rewrite the index after the save files
+    void addIndexWrite(SaveJob& job) {
+        if (currentSlot < 0) {
+            return;
+        }
+        if (!saveDirectoryReady) {
+            mkdir(saveDirectory.c_str(), 0755);
+            saveDirectoryReady = true;
+        }
+        saveIndex.update(currentSlot, enemyCount, bombsPlanted);
+        vector<unsigned char> index;
+        saveIndex.serialize(index);
+        job.writes.push_back({indexPath(), move(index), false});
+    }
+
+    // Apply journal records on top of the state restored from a checkpoint.
+    // Stops at the first record that is torn or does not fit the board.
+    void replayJournal(const unsigned char* data, size_t size) {
+        JournalReader in(data, size);
+        auto inside = [](int x, int y) { return x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT; };
+        while (!in.atEnd()) {
+            int type = in.get8();
+            if (type == JOURNAL_TILE && in.has(5)) {
+                int x = in.get16(), y = in.get16();
+                char symbol = in.get8();
+                if (!inside(x, y)) return;
+                if (grid[y][x] != exitDoor) delete grid[y][x];
+                grid[y][x] = nullptr;
+                placeTile(x, y, symbol);
+                if (symbol == ' ') connectivity->openCell(x, y);
+            } else if (type == JOURNAL_PLAYER && in.has(4)) {
+                int x = in.get16(), y = in.get16();
+                if (!inside(x, y)) return;
+                players[0]->move(x - players[0]->getX(), y - players[0]->getY());
+            } else if (type == JOURNAL_ENEMY_MOVE && in.has(10)) {
+                uint32_t index = in.get32();
+                int x = in.get16(), y = in.get16();
+                int dirX = in.getSigned8(), dirY = in.getSigned8();
+                if (index >= (uint32_t)enemyCount || !inside(x, y)) return;
+                moveEnemy(enemies[index], x - enemies[index]->getX(), y - enemies[index]->getY());
+                enemies[index]->setHeading(dirX, dirY);
+            } else if (type == JOURNAL_ENEMY_REMOVE && in.has(4)) {
+                uint32_t index = in.get32();
+                if (index >= (uint32_t)enemyCount) return;
+                removeEnemy(index);
+            } else if (type == JOURNAL_BOMB_PLANT && in.has(4)) {
+                int x = in.get16(), y = in.get16();
+                if (!inside(x, y) || bombCount >= NUM_BOMBS) return;
+                addBomb(new Bomb(x, y));
+                players[0]->useBomb();
+                bombsPlanted++;
+            } else if (type == JOURNAL_BOMB_REMOVE && in.has(4)) {
+                uint32_t index = in.get32();
+                if (index >= (uint32_t)bombCount) return;
+                removeBomb(index);
+                players[0]->reloadBomb();
+            } else if (type == JOURNAL_EXIT_VISIBLE) {
+                exitDoor->setVisible(true);
+            } else {
+                return;
+            }
+        }
+    }
+
+    // Replay the journal file if it belongs to the checkpoint that was just restored
+    void loadJournal(const unsigned char* checkpoint, size_t checkpointBytes) {
+        int fd = open(journalFileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(JournalHeader)) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                const JournalHeader* header = static_cast<const JournalHeader*>(data);
+                if (header->magic == JOURNAL_MAGIC && header->version == JOURNAL_VERSION &&
+                    header->checkpointHash == hashBytes(checkpoint, checkpointBytes)) {
+                    replayJournal(static_cast<const unsigned char*>(data) + sizeof(JournalHeader),
+                                  info.st_size - sizeof(JournalHeader));
+                }
+                munmap(data, info.st_size);
+            }
+        }
+        close(fd);
+    }
+
+    // Function to load the game state from the binary save file, mapped into memory
+    bool loadBinaryGame() {
+        int fd = open(binarySaveFileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        bool loaded = false;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                loaded = restore(static_cast<const unsigned char*>(data), info.st_size);
+                if (loaded) {
+                    loadJournal(static_cast<const unsigned char*>(data), info.st_size);
+                    touchAllRows();
+                }
+                munmap(data, info.st_size);
+            }
+        }
+        close(fd);
+        return loaded;
+    }
+
+    // Function to load the game state; the binary save is preferred over the text export,
+    // which only exists for the legacy save files
+    bool loadGame() {
+        return loadBinaryGame() || (currentSlot < 0 && loadTextGame(saveFileName));
+    }
+
+    // Read a text save. The first pass (apply == false) only validates; the second one, which runs
+    // only after a successful first pass, rebuilds the game, so a bad file never leaves a half-loaded game.
+    bool readTextSave(TextSaveParser& in, bool apply) {
+        // Load player position and bombs planted
+        int playerX, playerY, planted, savedEnemies;
+        if (!in.readInt(playerX, 0, WIDTH - 1) || !in.readInt(playerY, 0, HEIGHT - 1) ||
+            !in.readInt(planted, 0, INT_MAX) || !in.readInt(savedEnemies, 0, WIDTH * HEIGHT)) {
+            return false;
+        }
+        if (apply) {
+            // Clear existing game state
+            clearState();
+            journal.stop();
+            delete players[0];
+            players[0] = new Player(playerX, playerY);
+            playersCaught = 0;
+            bombsPlanted = planted;
+            resetEnemies(savedEnemies);
+        }
+
+        // Load enemy positions
+        for (int i = 0; i < savedEnemies; i++) {
+            int x, y, moveType;
+            if (!in.readInt(x, 0, WIDTH - 1) || !in.readInt(y, 0, HEIGHT - 1) || !in.readInt(moveType, 0, NUM_ENEMY_TYPES - 1)) {
+                return false;
+            }
+            if (apply) {
+                addEnemy(new Enemy(x, y, moveType));
+                if (x == playerX && y == playerY) {
+                    playersCaught |= 1;
+                }
+            }
+        }
+
+        // Load bomb positions
+        int savedBombs;
+        if (!in.readInt(savedBombs, 0, NUM_BOMBS)) {
+            return false;
+        }
+        if (apply) {
+            bombCount = 0;
+            bombs = new Bomb*[MAX_BOMBS];
+        }
+        for (int i = 0; i < savedBombs; i++) {
+            int x, y;
+            if (!in.readInt(x, 0, WIDTH - 1) || !in.readInt(y, 0, HEIGHT - 1)) {
+                return false;
+            }
+            if (apply) {
+                addBomb(new Bomb(x, y));
+                players[0]->useBomb();
+            }
+        }
+
+        // Load exit door position
+        int exitX, exitY, visible;
+        if (!in.readInt(exitX, 0, WIDTH - 1) || !in.readInt(exitY, 0, HEIGHT - 1) || !in.readInt(visible, 0, 1) || !in.endLine()) {
+            return false;
+        }
+        if (apply) {
+            delete exitDoor;
+            exitDoor = new ExitDoor(exitX, exitY);
+            exitDoor->setVisible(visible);
+        }
+
+        // Load grid state
+        for (int i = 0; i < HEIGHT; i++) {
+            const char* row;
+            if (!in.readRow(row)) {
+                return false;
+            }
+            if (apply) {
+                for (int j = 0; j < WIDTH; j++) {
+                    placeTile(j, i, row[j]);
+                }
+            }
+        }
+
+        if (apply) {
+            // Make the green brick on the exit door, if it is not visible
+            if (!exitDoor->isVisible()) {
+                if (grid[exitY][exitX] != exitDoor) delete grid[exitY][exitX];
+                grid[exitY][exitX] = new DestructibleBlock(exitX, exitY, true);
+            }
+            connectivity->build(grid);
+            touchAllRows();
+        }
+        return true;
+    }
+
+    // Function to load the game state from the text file, mapped into memory
+    bool loadTextGame(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        bool loaded = false;
+        if (fstat(fd, &info) == 0) {
+            void* data = info.st_size > 0 ? mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            const char* text = data != MAP_FAILED ? static_cast<const char*>(data) : "";
+            size_t size = data != MAP_FAILED ? info.st_size : 0;
+
+            TextSaveParser check(text, size);
+            if (readTextSave(check, false)) {
+                TextSaveParser in(text, size);
+                loaded = readTextSave(in, true);
+            } else {
+                char message[128];
+                snprintf(message, sizeof(message), "%s line %d, column %d: %s", path.c_str(),
+                         check.getErrorLine(), check.getErrorColumn(), check.getError());
+                loadError = message;
+            }
+            if (data != MAP_FAILED) {
+                munmap(data, info.st_size);
+            }
+        }
+        close(fd);
+        return loaded;
+    }
+
+    // Seed of a level; the first level uses the game's seed, so replays can regenerate every level
+    uint64_t levelSeed(int level) const {
+        return seed + (uint64_t)level * 0x9E3779B97F4A7C15ull;
+    }
+
+    // Whether winning the current level moves on to another one; random boards never run out
+    bool hasNextLevel() const {
+        return !levelPack || currentLevel + 1 < levelPack->getLevelCount();
+    }
+
+    // Build a level as a board of its own, ready to be swapped in; runs on the preloader thread
+    Game* buildLevel(int level) const {
+        // The constructor generates the random board; a pack level replaces it
+        Game* board = new Game(levelSeed(level));
+        board->setHeadless(true);
+        if (levelPack) {
+            board->setLevelPack(levelPack);
+            if (!board->enterLevel(level)) {
+                delete board;
+                return nullptr;
+            }
+        }
+        return board;
+    }
+
+    // Start building the next level in the background; the previous board is freed there too
+    void preloadNextLevel() {
+        if (headless || !hasNextLevel()) {
+            return;
+        }
+        if (preloader.joinable()) {
+            preloader.join();
+        }
+        Game* retired = retiredBoard;
+        retiredBoard = nullptr;
+        int level = currentLevel + 1;
+        preloader = thread([this, retired, level]() {
+            delete retired;
+            nextBoard = buildLevel(level);
+        });
+    }
+
+    // Exchange the boards of two games: tiles, entities, the scheduler and the reachability index
+    void swapBoard(Game& other) {
+        swap(grid, other.grid);
+        swap(players[0], other.players[0]);
+        swap(enemies, other.enemies);
+        swap(enemyCount, other.enemyCount);
+        swap(enemyCapacity, other.enemyCapacity);
+        for (int t = 0; t < NUM_ENEMY_TYPES; t++) {
+            for (int s = 0; s < SCHEDULE_SLOTS; s++) {
+                schedule[t][s].swap(other.schedule[t][s]);
+            }
+        }
+        for (int c = 0; c < CHUNK_ROWS * CHUNK_COLS; c++) {
+            enemyChunks[c].swap(other.enemyChunks[c]);
+        }
+        swap(staggered, other.staggered);
+        swap(playersCaught, other.playersCaught);
+        swap(bombs, other.bombs);
+        swap(bombCount, other.bombCount);
+        swap(exitDoor, other.exitDoor);
+        swap(connectivity, other.connectivity);
+    }
+
+    // Function to move on to the next level. The board is normally ready by now,
+    // so the handoff is a swap of pointers; false if the next level could not be built
+    bool advanceLevel() {
+        auto start = chrono::steady_clock::now();
+        if (preloader.joinable()) {
+            preloader.join();
+        }
+        Game* next = nextBoard;
+        nextBoard = nullptr;
+        if (!next) {
+            // Headless games (and a preloader that failed) build the level here
+            next = buildLevel(currentLevel + 1);
+            if (!next) {
+                return false;
+            }
+        }
+        bool firstAlive = players[0]->isAlive();
+        uint32_t firstInput = players[0]->getLastInput();
+        swapBoard(*next);
+        currentLevel++;
+        // The players of a network game start the new board in their corners; those who are out stay out
+        players[0]->setAlive(firstAlive);
+        players[0]->setLastInput(firstInput);
+        for (int k = 1; k < MAX_PLAYERS; k++) {
+            if (players[k]) {
+                players[k]->move(SPAWN_X[k] - players[k]->getX(), SPAWN_Y[k] - players[k]->getY());
+                players[k]->setBombs(NUM_BOMBS);
+            }
+        }
+        journal.stop();
+        forgetChanges();
+        touchAllRows();
+        lastHandoffMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        maxHandoffMicros = max(maxHandoffMicros, lastHandoffMicros);
+
+        // The old board now belongs to next
+        if (headless) {
+            delete next;
+        } else {
+            retiredBoard = next;
+            preloadNextLevel();
+        }
+        return true;
+    }
+
+public:
+    // Constructor
+    Game(uint64_t seed = (uint64_t)time(nullptr))
+        : enemyCount(0), enemyCapacity(0), tick(0), staggered(0), playersCaught(0),
+          connectivity(new Connectivity()), freeCells(new FreeCells()),
+          checkpointSize(0), bombCount(0), exitDoor(nullptr), seed(seed), random(seed), replay(&saveWriter), session(&saveWriter) {
+        // Initialize the grid with nullptr
+        grid = new Entity**[HEIGHT];
+        for (int i = 0; i < HEIGHT; i++) {
+            grid[i] = new Entity*[WIDTH];
+            for (int j = 0; j < WIDTH; j++) {
+                grid[i][j] = nullptr;
+            }
+        }
+        initializeGame();
+    }
+
+    // Destructor
+    ~Game() {
+        if (preloader.joinable()) {
+            preloader.join();
+        }
+        delete nextBoard;
+        delete retiredBoard;
+        // Delete all entities and deallocate memory
+        clearState();
+        for (int i = 0; i < HEIGHT; i++) {
+            delete[] grid[i];
+        }
+        delete[] grid;
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            delete players[k];
+        }
+        delete exitDoor;
+    }
+
+    // Delete every tile of the grid
+    void clearGrid() {
+        for (int i = 0; i < HEIGHT; i++) {
+            for (int j = 0; j < WIDTH; j++) {
+                // A visible exit door loaded from a save sits in the grid, but it is owned by exitDoor
+                if (grid[i][j] != exitDoor) delete grid[i][j];
+                grid[i][j] = nullptr;
+            }
+        }
+    }
+
+    // Getters used by consumers that read the board without going through the text save
+    Entity* getTile(int x, int y) const { return grid[y][x]; }
+    const Player* getPlayer(int slot = 0) const { return players[slot]; }
+    const Enemy* getEnemy(int i) const { return enemies[i]; }
+    int getEnemyCount() const { return enemyCount; }
+    const Bomb* getBomb(int i) const { return bombs[i]; }
+    int getBombCount() const { return bombCount; }
+    const ExitDoor* getExitDoor() const { return exitDoor; }
+    unsigned getRowVersion(int y) const { return rowVersion[y]; }
+    const Connectivity& getConnectivity() const { return *connectivity; }
+    const string& getLoadError() const { return loadError; }
+
+    // Choose how the tiles of checkpoints are compressed (SAVE_FLAG_* or 0 for raw tiles)
+    void setSaveCompression(int flags) { saveCompression = flags; }
+
+    // Draw the game with another renderer (e.g. AnsiRenderer); the game does not take ownership
+    void setRenderer(Renderer* value) { renderer = value; }
+
+    // Register a function to be called after every game tick
+    void setTickListener(function<void(const Game&)> listener) { tickListener = listener; }
+
+    // Record the inputs of new games to a replay file
+    void setReplayFile(const string& path) { replayFileName = path; }
+
+    // Record the screen of the games played to a session file
+    void setSessionFile(const string& path) { sessionFileName = path; }
+
+    // Play the levels of a pack instead of random boards
+    void setLevelPack(LevelPack* pack) { levelPack = pack; }
+    int getCurrentLevel() const { return currentLevel; }
+    long getLastHandoffMicros() const { return lastHandoffMicros; }
+    long getMaxHandoffMicros() const { return maxHandoffMicros; }
+
+    // Function to enter a level of the level pack; it is decoded from the mapped pack only now
+    bool enterLevel(int level) {
+        const unsigned char* data;
+        size_t size;
+        if (!levelPack || !levelPack->getLevel(level, data, size) || !restore(data, size)) {
+            loadError = "Level " + to_string(level + 1) + " of the level pack is damaged";
+            return false;
+        }
+        // The level now lives in the game's own objects
+        levelPack->release();
+        currentLevel = level;
+        return true;
+    }
+
+    // Function to read an authored level (a text export) and encode it as a level pack entry
+    bool importLevel(const string& path, vector<unsigned char>& image) {
+        loadError.clear();
+        if (!loadTextGame(path)) {
+            return false;
+        }
+        serialize(image);
+        return true;
+    }
+
+    // Run without the terminal, e.g. to play back a replay
+    void setHeadless(bool value) { headless = value; }
+    // Run ahead of a server's game as a prediction of it (see predict)
+    void setPredicted(bool value) { predicted = value; }
+    // Player this terminal plays in a network game
+    void setLocalSlot(int slot) { localSlot = slot; }
+    bool isFinished() const { return finished; }
+    const string& getResult() const { return result; }
+    uint64_t getFinishHash() const { return finishHash; }
+    unsigned long getTick() const { return tick; }
+
+    // Hash of everything that decides how the game goes on: the board, the entities, the tick and the generator
+    uint64_t stateHash() const {
+        uint64_t hash = hashBytes(nullptr, 0);
+        char row[WIDTH];
+        for (int i = 0; i < HEIGHT; i++) {
+            for (int j = 0; j < WIDTH; j++) {
+                row[j] = grid[i][j] ? grid[i][j]->getSymbol() : ' ';
+            }
+            hash = hashBytes((const unsigned char*)row, WIDTH, hash);
+        }
+        int32_t values[5] = {players[0]->getX(), players[0]->getY(), enemyCount, bombCount, exitDoor->isVisible()};
+        hash = hashBytes((const unsigned char*)values, sizeof(values), hash);
+        for (int k = 1; k < MAX_PLAYERS; k++) {
+            if (players[k]) {
+                int32_t p[4] = {k, players[k]->getX(), players[k]->getY(), players[k]->isAlive()};
+                hash = hashBytes((const unsigned char*)p, sizeof(p), hash);
+            }
+        }
+        for (int i = 0; i < enemyCount; i++) {
+            int32_t e[5] = {enemies[i]->getX(), enemies[i]->getY(), enemies[i]->getMoveType(),
+                            enemies[i]->getDirX(), enemies[i]->getDirY()};
+            hash = hashBytes((const unsigned char*)e, sizeof(e), hash);
+        }
+        for (int i = 0; i < bombCount; i++) {
+            int32_t b[3] = {bombs[i]->getX(), bombs[i]->getY(), bombs[i]->fuseRemainingMs()};
+            hash = hashBytes((const unsigned char*)b, sizeof(b), hash);
+        }
+        uint64_t clock[2] = {tick, random.getState()};
+        return hashBytes((const unsigned char*)clock, sizeof(clock), hash);
+    }
+
+    // The action a key press stands for (ACTION_NONE for keys that do not change the game)
+    static int actionForKey(int ch) {
+        switch (ch) {
+            case 'w': case KEY_UP: return ACTION_UP;
+            case 's': case KEY_DOWN: return ACTION_DOWN;
+            case 'a': case KEY_LEFT: return ACTION_LEFT;
+            case 'd': case KEY_RIGHT: return ACTION_RIGHT;
+            case ' ': return ACTION_BOMB;
+            default: return ACTION_NONE;
+        }
+    }
+
+    // Function to apply the input of the player in a slot for this tick; players who are out cannot act
+    void applyAction(int action, int slot = 0) {
+        if (!players[slot] || !players[slot]->isAlive()) {
+            return;
+        }
+        switch (action) {
+            case ACTION_UP: movePlayer(slot, 0, -1); break;
+            case ACTION_DOWN: movePlayer(slot, 0, 1); break;
+            case ACTION_LEFT: movePlayer(slot, -1, 0); break;
+            case ACTION_RIGHT: movePlayer(slot, 1, 0); break;
+            case ACTION_BOMB: plantBomb(slot); break;
+        }
+    }
+
+    // Function to put a new player in a slot of a network game, at the slot's starting point
+    void addPlayer(int slot) {
+        if (players[slot]) {
+            touchRow(players[slot]->getY());
+            delete players[slot];
+        }
+        players[slot] = new Player(SPAWN_X[slot], SPAWN_Y[slot]);
+        players[slot]->setChangedTick(changeTick());
+        onlineSlots |= 1u << slot;
+        touchRow(SPAWN_Y[slot]);
+    }
+
+    // Function to take the player of a client that left a network game off the board
+    void removePlayer(int slot) {
+        onlineSlots &= ~(1u << slot);
+        if (players[slot] && players[slot]->isAlive()) {
+            killPlayer(slot, "Every player left the game!");
+        }
+    }
+
+    // Function to record which network input of the player in a slot was applied last
+    void setLastInput(int slot, uint32_t sequence) {
+        players[slot]->setLastInput(sequence);
+        players[slot]->setChangedTick(changeTick());
+    }
+
+    // Whether writeDelta can still tell everything that changed after the given tick
+    bool canDeltaFrom(unsigned long since) const {
+        return since >= forgottenTick && since <= tick;
+    }
+
+    // NetTile code of a tile
+    static int tileCode(const Entity* tile) {
+        if (!tile) return NET_TILE_EMPTY;
+        switch (tile->getSymbol()) {
+            case INDESTRUCTIBLE_BLOCK: return NET_TILE_INDESTRUCTIBLE;
+            case DESTRUCTIBLE_BLOCK:
+                return static_cast<const DestructibleBlock*>(tile)->isGreenBlock() ? NET_TILE_GREEN : NET_TILE_DESTRUCTIBLE;
+            case TRAP: return NET_TILE_TRAP;
+            default: return NET_TILE_EXIT;
+        }
+    }
+
+    // Function to replace the tile at (x, y) with a new one of a NetTile code
+    void placeNetTile(int x, int y, int code) {
+        if (grid[y][x] != exitDoor) delete grid[y][x];
+        grid[y][x] = nullptr;
+        switch (code) {
+            case NET_TILE_INDESTRUCTIBLE: grid[y][x] = new IndestructibleBlock(x, y); break;
+            case NET_TILE_DESTRUCTIBLE: grid[y][x] = new DestructibleBlock(x, y); break;
+            case NET_TILE_GREEN: grid[y][x] = new DestructibleBlock(x, y, true); break;
+            case NET_TILE_TRAP: grid[y][x] = new Trap(x, y); break;
+            case NET_TILE_EXIT: grid[y][x] = exitDoor; break;
+        }
+    }
+
+    // Function to describe the game for a client of a network game, bit-packed: everything that changed after
+    // the given tick (the last state the client acknowledged), or the whole game when full is set.
+    // Values are sent as they are now rather than as differences, so the client can apply them to any state
+    // it has from that tick on. Entities are named by stable ids, positions are varint cell numbers
+    // (y * WIDTH + x), and every list ends with a 0 (ids are sent + 1).
+    void writeDelta(BitWriter& out, uint32_t epoch, unsigned long since, bool full) const {
+        static_assert(NUM_BOMBS < 4 && MAX_PLAYERS <= 4 && NUM_ENEMY_TYPES <= 8 && SCHEDULE_SLOTS <= 16,
+                      "A state field is too narrow");
+        auto cellOf = [](const Entity* entity) { return (uint64_t)entity->getY() * WIDTH + entity->getX(); };
+        auto changed = [&](const Entity* entity) { return full || entity->getChangedTick() > since; };
+
+        out.putVarint(epoch);
+        out.putVarint(tick);
+        out.put(full, 1);
+        if (full) {
+            out.putVarint(cellOf(exitDoor));
+            out.putVarint(enemyCapacity);
+        } else {
+            out.putVarint(since);
+        }
+        out.putVarint(currentLevel);
+        out.putVarint(bombsPlanted);
+        out.put(playersCaught, MAX_PLAYERS);
+        out.put(onlineSlots, MAX_PLAYERS);
+        out.put(exitDoor->isVisible(), 1);
+        // The generator state lets the client run the enemies exactly as the server will
+        bool randomMoved = full || randomChanged > since;
+        out.put(randomMoved, 1);
+        if (randomMoved) {
+            out.put((uint32_t)random.getState(), 32);
+            out.put((uint32_t)(random.getState() >> 32), 32);
+        }
+
+        // Players: a bit per slot, followed by the player if it changed
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            const Player* player = players[k];
+            out.put(player && changed(player), 1);
+            if (player && changed(player)) {
+                out.put(player->isAlive(), 1);
+                out.put(player->getBombs(), 2);
+                out.putVarint(cellOf(player));
+                out.putVarint(player->getLastInput());
+            }
+        }
+
+        // Tiles: the gap from the previous cell listed and the NetTile code, for the cells that changed
+        // (in a full state, for the cells that are not empty)
+        uint64_t previous = (uint64_t)-1;
+        for (int i = 0; i < HEIGHT; i++) {
+            if (!full && rowChanges[i] <= since) {
+                continue;
+            }
+            for (int j = 0; j < WIDTH; j++) {
+                uint64_t cell = (uint64_t)i * WIDTH + j;
+                if (full ? !grid[i][j] : tileChanges[cell] <= since) {
+                    continue;
+                }
+                out.putVarint(cell - previous);
+                out.put(tileCode(grid[i][j]), NET_TILE_BITS);
+                previous = cell;
+            }
+        }
+        out.putVarint(0);
+
+        // Enemies that moved or turned: id, cell and heading. A full state has all of them in roster order,
+        // with the archetype and the place in the scheduler; the client runs the scheduler from then on
+        for (int i = 0; i < enemyCount; i++) {
+            const Enemy* enemy = enemies[i];
+            if (!changed(enemy)) {
+                continue;
+            }
+            out.putVarint(enemy->getId() + 1);
+            out.putVarint(cellOf(enemy));
+            out.put(directionIndex(enemy->getDirX(), enemy->getDirY()), 2);
+            if (full) {
+                out.put(enemy->getMoveType(), 3);
+                out.put(enemy->getSlot(), 4);
+                out.putVarint(enemy->getSlotIndex());
+            }
+        }
+        out.putVarint(0);
+        // Enemies killed, in the order they died, each with the gap from the previous one's tick: the client
+        // takes them out at the same point between scheduler steps, which keeps its roster and buckets in the
+        // server's order (and so the enemies drawing the same random numbers)
+        size_t first = enemyRemovals.size();
+        while (!full && first > 0 && enemyRemovals[first - 1].second > since) {
+            first--;
+        }
+        uint32_t previousTick = since;
+        for (size_t i = first; i < enemyRemovals.size(); i++) {
+            out.putVarint(enemyRemovals[i].first + 1);
+            out.putVarint(enemyRemovals[i].second - previousTick);
+            previousTick = enemyRemovals[i].second;
+        }
+        out.putVarint(0);
+
+        // Bombs, if any was planted or went off: every bomb in the order they burn in, by id. Bombs planted
+        // since the base follow with their cell, owner and the ticks left on the fuse; the client burns the
+        // fuses of the others, and bombs no longer listed have gone off
+        bool bombsMoved = full || bombsChanged > since;
+        out.put(bombsMoved, 1);
+        if (bombsMoved) {
+            out.putVarint(nextBombId);
+            out.putVarint(bombCount);
+            for (int i = 0; i < bombCount; i++) {
+                out.putVarint(bombs[i]->getId());
+                out.put(changed(bombs[i]), 1);
+                if (changed(bombs[i])) {
+                    out.putVarint(cellOf(bombs[i]));
+                    out.put(bombs[i]->getOwner(), 2);
+                    out.putVarint(bombs[i]->getFuseTicks());
+                }
+            }
+        }
+    }
+
+    // Function to run the scheduler for one tick without moving anyone: the enemies due wait their period
+    // again, in the order updateBucket puts them back in
+    void stepSchedule(unsigned long at) {
+        for (int type = 0; type < NUM_ENEMY_TYPES; type++) {
+            vector<Enemy*>& due = schedule[type][at % SCHEDULE_SLOTS];
+            for (Enemy* enemy : due) {
+                scheduleEnemy(enemy, at + ENEMY_MOVE_PERIOD[type]);
+            }
+            due.clear();
+        }
+    }
+
+    // Function to apply a state from the server (see writeDelta) on top of the states applied before it.
+    // False if it is damaged, or holds changes that do not follow on from this game.
+    bool applyDelta(const unsigned char* data, size_t size) {
+        BitReader in(data, size);
+        auto inBoard = [](uint64_t cell) { return cell < (uint64_t)WIDTH * HEIGHT; };
+        uint32_t epoch = in.getVarint();
+        unsigned long newTick = in.getVarint();
+        unsigned long since = 0;
+        bool full = in.get(1);
+        uint64_t exitCell = 0, capacity = 0;
+        if (full) {
+            exitCell = in.getVarint();
+            capacity = in.getVarint();
+            if (!inBoard(exitCell) || capacity > (uint64_t)WIDTH * HEIGHT) return false;
+        } else {
+            since = in.getVarint();
+            if (epoch != stateEpoch || since > tick || newTick < tick) return false;
+        }
+        int level = in.getVarint();
+        int planted = in.getVarint();
+        unsigned caught = in.get(MAX_PLAYERS);
+        unsigned online = in.get(MAX_PLAYERS);
+        bool exitVisible = in.get(1);
+        uint64_t randomState = 0;
+        if (in.get(1)) {
+            randomState = in.get(32);
+            randomState |= (uint64_t)in.get(32) << 32;
+            if (!randomState) return false;
+        }
+        if (in.hasFailed()) {
+            return false;
+        }
+
+        if (full) {
+            // Start over from an empty board
+            clearState();
+            journal.stop();
+            forgetChanges();
+            resetEnemies(capacity);
+            enemiesById.assign(capacity, nullptr);
+            bombs = new Bomb*[MAX_BOMBS];
+            bombCount = 0;
+            delete exitDoor;
+            exitDoor = new ExitDoor(exitCell % WIDTH, exitCell / WIDTH);
+            for (int k = 1; k < MAX_PLAYERS; k++) {
+                delete players[k];
+                players[k] = nullptr;
+            }
+            touchAllRows();
+        } else {
+            // The fuses burnt in the ticks since the last state, as on the server
+            for (int i = 0; i < bombCount; i++) {
+                for (unsigned long t = tick; t < newTick && !bombs[i]->shouldExplode(); t++) {
+                    bombs[i]->burn();
+                }
+                touchRow(bombs[i]->getY());
+            }
+        }
+        unsigned long oldTick = tick;
+        stateEpoch = epoch;
+        tick = newTick;
+        currentLevel = level;
+        bombsPlanted = planted;
+        playersCaught = caught;
+        onlineSlots = online;
+        exitDoor->setVisible(exitVisible);
+        touchRow(exitDoor->getY());
+        if (randomState) {
+            random.setState(randomState);
+        }
+
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if (!in.get(1)) {
+                continue;
+            }
+            bool alive = in.get(1);
+            int bombsInHand = in.get(2);
+            uint64_t cell = in.getVarint();
+            uint32_t lastInput = in.getVarint();
+            if (in.hasFailed() || !inBoard(cell)) return false;
+            int x = cell % WIDTH, y = cell / WIDTH;
+            if (!players[k]) {
+                players[k] = new Player(x, y);
+            }
+            touchRow(players[k]->getY());
+            players[k]->move(x - players[k]->getX(), y - players[k]->getY());
+            players[k]->setAlive(alive);
+            players[k]->setBombs(bombsInHand);
+            players[k]->setLastInput(lastInput);
+            touchRow(y);
+        }
+
+        bool rebuild = full;    // Tiles that are not opened up need the regions labelled again
+        uint64_t cell = (uint64_t)-1;
+        while (uint64_t gap = in.getVarint()) {
+            int code = in.get(NET_TILE_BITS);
+            cell += gap;
+            if (in.hasFailed() || gap > (uint64_t)WIDTH * HEIGHT || !inBoard(cell) || code > NET_TILE_EXIT) return false;
+            int x = cell % WIDTH, y = cell / WIDTH;
+            placeNetTile(x, y, code);
+            if (code != NET_TILE_EMPTY) {
+                rebuild = true;
+            } else if (!full) {
+                connectivity->openCell(x, y);
+            }
+            touchRow(y);
+        }
+
+        while (uint64_t id = in.getVarint()) {
+            uint64_t cell = in.getVarint();
+            int heading = in.get(2);
+            int type = full ? in.get(3) : 0;
+            int slot = full ? in.get(4) : 0;
+            uint64_t index = full ? in.getVarint() : 0;
+            if (in.hasFailed() || --id >= enemiesById.size() || !inBoard(cell) || type >= NUM_ENEMY_TYPES ||
+                index >= enemiesById.size()) return false;
+            int x = cell % WIDTH, y = cell / WIDTH;
+            Enemy* enemy = enemiesById[id];
+            if (full) {
+                if (enemy || enemyCount >= enemyCapacity) return false;
+                enemy = new Enemy(x, y, type);
+                enemy->setId(id);
+                listEnemy(enemy);
+                // Put it where the server has it in its bucket; the gaps are filled in by the enemies after it
+                vector<Enemy*>& bucket = schedule[type][slot];
+                if (bucket.size() <= index) bucket.resize(index + 1, nullptr);
+                if (bucket[index]) return false;
+                bucket[index] = enemy;
+                enemy->setSlot(slot, index);
+                enemiesById[id] = enemy;
+            } else {
+                // Enemies only ever appear with a new board
+                if (!enemy) return false;
+                touchRow(enemy->getY());
+                moveEnemy(enemy, x - enemy->getX(), y - enemy->getY());
+            }
+            enemy->setHeading(DIR_X[heading], DIR_Y[heading]);
+            touchRow(y);
+        }
+        if (full) {
+            for (int type = 0; type < NUM_ENEMY_TYPES; type++) {
+                for (const vector<Enemy*>& bucket : schedule[type]) {
+                    for (const Enemy* enemy : bucket) {
+                        if (!enemy) return false;
+                    }
+                }
+            }
+        }
+
+        // Enemy removals; those up to the tick after the last state (see changeTick) were taken out with it
+        removalsReceived.clear();
+        uint64_t removalTick = since;
+        while (uint64_t id = in.getVarint()) {
+            removalTick += in.getVarint();
+            if (in.hasFailed() || full || --id >= enemiesById.size() || removalTick > newTick + 1) return false;
+            if (removalTick > oldTick + 1) {
+                removalsReceived.push_back({id, removalTick});
+            }
+        }
+        // Run the scheduler through the ticks since the last state, taking the enemies killed out after the
+        // bucket walk of the tick they died in, as update does
+        size_t next = 0;
+        for (unsigned long t = full ? newTick : oldTick; t < newTick; t++) {
+            stepSchedule(t);
+            for (; next < removalsReceived.size() && removalsReceived[next].second == t + 2; next++) {
+                Enemy* enemy = enemiesById[removalsReceived[next].first];
+                if (!enemy) return false;
+                touchRow(enemy->getY());
+                removeEnemy(enemy->getRosterIndex());
+            }
+        }
+
+        if (in.get(1)) {
+            // The bombs in the server's order: the ones already here are picked out of the old list, and what
+            // is left of that has gone off
+            Bomb* listed[MAX_BOMBS];
+            uint64_t nextId = in.getVarint();
+            uint64_t count = in.getVarint();
+            if (in.hasFailed() || count > MAX_BOMBS) return false;
+            for (uint64_t i = 0; i < count; i++) {
+                uint64_t id = in.getVarint();
+                Bomb* bomb = nullptr;
+                for (int j = 0; j < bombCount && !bomb; j++) {
+                    if (bombs[j]->getId() == id) {
+                        bomb = bombs[j];
+                        bombs[j] = bombs[--bombCount];
+                    }
+                }
+                if (in.get(1)) {
+                    uint64_t cell = in.getVarint();
+                    int owner = in.get(2);
+                    uint64_t fuse = in.getVarint();
+                    // A bomb that is already here has burnt its fuse down along with the ticks
+                    if (!bomb && !in.hasFailed() && inBoard(cell) && fuse <= BOMB_FUSE_TICKS) {
+                        bomb = new Bomb(cell % WIDTH, cell / WIDTH, fuse * TICK_MS, owner);
+                        bomb->setId(id);
+                    }
+                }
+                if (!bomb) {
+                    for (uint64_t j = 0; j < i; j++) {
+                        delete listed[j];
+                    }
+                    return false;
+                }
+                listed[i] = bomb;
+                touchRow(bomb->getY());
+            }
+            for (int j = 0; j < bombCount; j++) {
+                touchRow(bombs[j]->getY());
+                delete bombs[j];
+            }
+            copy(listed, listed + count, bombs);
+            bombCount = count;
+            nextBombId = nextId;
+        }
+
+        if (rebuild) {
+            connectivity->build(grid);
+        }
+        return !in.hasFailed();
+    }
+
+    // Epoch and tick of the last state applied, to acknowledge it
+    uint32_t getStateEpoch() const { return stateEpoch; }
+
+    // Function to make this game a copy of another one that a network client keeps (see applyDelta), e.g. to roll a
+    // prediction back to the last state from the server. Only what differs is rebuilt, and the entities
+    // still on the board are reused, so a rollback allocates next to nothing.
+    void restoreFrom(const Game& other) {
+        *exitDoor = *other.exitDoor;
+        for (int i = 0; i < HEIGHT; i++) {
+            for (int j = 0; j < WIDTH; j++) {
+                int code = tileCode(other.grid[i][j]);
+                if (tileCode(grid[i][j]) != code) {
+                    placeNetTile(j, i, code);
+                }
+            }
+        }
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if (!other.players[k]) {
+                delete players[k];
+                players[k] = nullptr;
+            } else if (!players[k]) {
+                players[k] = new Player(*other.players[k]);
+            } else {
+                *players[k] = *other.players[k];
+            }
+        }
+
+        // Enemies by id: those the other game no longer has go, the missing ones are made, and then the roster
+        // and the scheduler buckets take the other game's order
+        if (enemyCapacity != other.enemyCapacity) {
+            for (int i = 0; i < enemyCount; i++) {
+                delete enemies[i];
+            }
+            delete[] enemies;
+            resetEnemies(other.enemyCapacity);
+            enemiesById.clear();
+        }
+        enemiesById.resize(other.enemiesById.size(), nullptr);
+        for (int i = 0; i < enemyCount; i++) {
+            Enemy* enemy = enemies[i];
+            size_t id = enemy->getId();
+            bool known = id < enemiesById.size() && enemiesById[id] == enemy;
+            if (!known || !other.enemiesById[id]) {
+                if (known) enemiesById[id] = nullptr;
+                unindexEnemy(enemy);
+                delete enemy;
+            }
+        }
+        for (int i = 0; i < other.enemyCount; i++) {
+            const Enemy* source = other.enemies[i];
+            Enemy*& enemy = enemiesById[source->getId()];
+            if (enemy && enemy->getMoveType() != source->getMoveType()) {
+                unindexEnemy(enemy);
+                delete enemy;
+                enemy = nullptr;
+            }
+            if (!enemy) {
+                enemy = new Enemy(source->getX(), source->getY(), source->getMoveType());
+                enemy->setId(source->getId());
+                indexEnemy(enemy);
+            } else {
+                moveEnemy(enemy, source->getX() - enemy->getX(), source->getY() - enemy->getY());
+            }
+            enemy->setHeading(source->getDirX(), source->getDirY());
+            enemy->setChangedTick(source->getChangedTick());
+            enemy->setRosterIndex(i);
+            enemies[i] = enemy;
+        }
+        enemyCount = other.enemyCount;
+        for (int t = 0; t < NUM_ENEMY_TYPES; t++) {
+            for (int slot = 0; slot < SCHEDULE_SLOTS; slot++) {
+                vector<Enemy*>& bucket = schedule[t][slot];
+                bucket.clear();
+                for (const Enemy* source : other.schedule[t][slot]) {
+                    Enemy* enemy = enemiesById[source->getId()];
+                    enemy->setSlot(slot, bucket.size());
+                    bucket.push_back(enemy);
+                }
+            }
+        }
+        staggered = other.staggered;
+
+        // Bombs by id, in the other game's order
+        Bomb* kept[MAX_BOMBS];
+        for (int i = 0; i < other.bombCount; i++) {
+            Bomb* bomb = nullptr;
+            for (int j = 0; j < bombCount && !bomb; j++) {
+                if (bombs[j]->getId() == other.bombs[i]->getId()) {
+                    bomb = bombs[j];
+                    bombs[j] = bombs[--bombCount];
+                }
+            }
+            if (bomb) {
+                *bomb = *other.bombs[i];
+            } else {
+                bomb = new Bomb(*other.bombs[i]);
+            }
+            kept[i] = bomb;
+        }
+        for (int j = 0; j < bombCount; j++) {
+            delete bombs[j];
+        }
+        copy(kept, kept + other.bombCount, bombs);
+        bombCount = other.bombCount;
+
+        tick = other.tick;
+        random = other.random;
+        playersCaught = other.playersCaught;
+        bombsPlanted = other.bombsPlanted;
+        currentLevel = other.currentLevel;
+        onlineSlots = other.onlineSlots;
+        nextBombId = other.nextBombId;
+        stateEpoch = other.stateEpoch;
+        finished = other.finished;
+        *connectivity = *other.connectivity;
+        touchAllRows();
+    }
+
+    // Function to apply the local player's actions that are due on this tick
+    void applyPredictedInputs(const vector<PredictedInput>& inputs) {
+        for (const PredictedInput& input : inputs) {
+            if (input.tick == tick) {
+                applyAction(input.action, localSlot);
+                setLastInput(localSlot, input.sequence);
+            }
+        }
+    }
+
+    // Function to run one tick of a prediction
+    void predictTick(const vector<PredictedInput>& inputs) {
+        update();
+        applyPredictedInputs(inputs);
+    }
+
+    // Function to predict a server's game up to a tick: roll back to the last state from the server, drop the
+    // actions it acknowledged, and run the ticks since again with the rest. The server applies one action of a
+    // player per tick, from the tick it gets there on, so the rest are moved to the earliest ticks it can use.
+    // The ticks are deterministic, so a prediction with the right actions is exactly the server's game.
+    void predict(const Game& confirmed, vector<PredictedInput>& inputs, unsigned long toTick) {
+        restoreFrom(confirmed);
+        uint32_t acknowledged = players[localSlot] ? players[localSlot]->getLastInput() : 0;
+        size_t done = 0;
+        while (done < inputs.size() && inputs[done].sequence <= acknowledged) {
+            done++;
+        }
+        inputs.erase(inputs.begin(), inputs.begin() + done);
+        unsigned long next = tick;
+        for (PredictedInput& input : inputs) {
+            input.tick = max(input.tick, next);
+            next = input.tick + 1;
+        }
+        applyPredictedInputs(inputs);
+        while (tick < toTick && !finished) {
+            predictTick(inputs);
+        }
+    }
+
+    // Function to display the game over screen
+    void gameOver(string causeOfDeath) {
+        replay.finish(tick, true, stateHash());
+        if (headless) {
+            if (!finished) {
+                result = "GAME OVER! " + causeOfDeath;
+                finishHash = stateHash();
+            }
+            finished = true;
+            return;
+        }
+        presenter.stop();
+        session.finish();
+        clear();
+        string toDisplay = "GAME OVER! " + causeOfDeath;
+        mvprintw(LINES / 2, COLS / 2 - 5, toDisplay.c_str());
+        refresh();
+        saveWriter.flush();
+        nodelay(stdscr, FALSE);
+        getch();
+        endwin();
+        exit(0);
+    }
+
+    // Function to display the game win screen
+    void gameWin() {
+        if (!predicted && hasNextLevel() && advanceLevel()) {
+            return;
+        }
+        replay.finish(tick, true, stateHash());
+        if (headless) {
+            if (!finished) {
+                result = "YOU WIN!";
+                finishHash = stateHash();
+            }
+            finished = true;
+            return;
+        }
+        presenter.stop();
+        session.finish();
+        clear();
+        mvprintw(LINES / 2, COLS / 2 - 5, "YOU WIN!");
+        refresh();
+        saveWriter.flush();
+        nodelay(stdscr, FALSE);
+        getch();
+        endwin();
+        exit(0);
+    }
+
+    // Function to initialize the game
+    void initializeGame() {
+        players[0] = new Player(1, 1);
+        bombsPlanted = 0;
+        playersCaught = 0;
+        journal.stop();
+
+        // Generate boards until the player can reach the exit; unwinnable boards are rejected
+        // before any enemy is placed.
+        // Spawns are drawn from the set of free cells, so every attempt is linear in the board size.
+        int exitX = 0, exitY = 0;
+        bool winnable = false;
+        for (int attempt = 0; attempt < MAX_BOARD_ATTEMPTS && !winnable; attempt++) {
+            clearGrid();
+            freeCells->clear();
+            exitX = exitY = 0;
+
+            // Adding blocks
+            for (int i = 0; i < HEIGHT; i++) {
+                for (int j = 0; j < WIDTH; j++) {
+                    // Adding indestructible blocks around the border
+                    if (i == 0 || i == HEIGHT - 1 || j == 0 || j == WIDTH - 1) {
+                        grid[i][j] = new IndestructibleBlock(j, i);
+                    }
+                    // Keep the player's starting area clear and out of the spawn set; player starts at (1, 1)
+                    else if (i <= 3 && j <= 3) {
+                        continue;
+                    }
+                    // Adding destructible blocks randomly
+                    else if (random.below(WIDTH) == 0) {
+                        grid[i][j] = new IndestructibleBlock(j, i);
+                    }
+                    // Adding destructible blocks randomly
+                    else if (random.below(HEIGHT) == 0) {
+                        grid[i][j] = new DestructibleBlock(j, i);
+                    }
+                    else {
+                        freeCells->insert(j, i);
+                    }
+                }
+            }
+
+            // Adding traps, leaving a free cell for the exit door
+            for (int i = 0; i < (HEIGHT + WIDTH) / 10 && freeCells->size() > 1; i++) {
+                int x, y;
+                freeCells->take(x, y, random);
+                grid[y][x] = new Trap(x, y);
+            }
+
+            // Adding exit door; a board without a free cell for it is rejected like an unwinnable one
+            if (freeCells->empty()) {
+                continue;
+            }
+            freeCells->take(exitX, exitY, random);
+            grid[exitY][exitX] = new DestructibleBlock(exitX, exitY, true);
+
+            connectivity->build(grid);
+            winnable = connectivity->reachableByBlasting(1, 1, exitX, exitY);
+        }
+        // Boards too small or too crowded to ever give a winnable layout: the exit goes in the
+        // player's starting area, which is always clear, instead of retrying without end
+        if (!winnable) {
+            if (exitX != 0) {
+                delete grid[exitY][exitX];
+                grid[exitY][exitX] = new DestructibleBlock(exitX, exitY);
+            }
+            exitX = exitY = 3;
+            grid[exitY][exitX] = new DestructibleBlock(exitX, exitY, true);
+            connectivity->build(grid);
+        }
+
+        // Adding exit door
+        exitDoor = new ExitDoor(exitX, exitY);
+
+        // Add enemies, at most one per free cell
+        int numEnemies = (HEIGHT + WIDTH) / 10;
+        resetEnemies(numEnemies);
+        for (int i = 0; i < numEnemies && !freeCells->empty(); i++) {
+            int x, y;
+            freeCells->take(x, y, random);
+            addEnemy(new Enemy(x, y, i % NUM_ENEMY_TYPES));
+        }
+
+
+        // Initialize bombs array
+        bombCount = 0;
+        bombs = new Bomb*[MAX_BOMBS]; // Room for the bombs of every player
+
+        touchAllRows();
+    }
+
+    // Origin of the view along one axis, scrolled as little as needed to keep the target
+    // at least CAMERA_MARGIN cells away from its edges, and never past the board
+    static int scrollView(int origin, int target, int size, int total) {
+        int margin = min(CAMERA_MARGIN, (size - 1) / 2);
+        if (target < origin + margin) {
+            origin = target - margin;
+        } else if (target > origin + size - 1 - margin) {
+            origin = target - size + 1 + margin;
+        }
+        return max(0, min(origin, total - size));
+    }
+
+    // Function to move the camera so the player stays in view
+    void followPlayer() {
+        viewX = scrollView(viewX, players[localSlot]->getX(), viewWidth, WIDTH);
+        viewY = scrollView(viewY, players[localSlot]->getY(), viewHeight, HEIGHT);
+    }
+
+    // Function to size the view to the terminal (the status lines, and the HUD if shown, go under it)
+    void fitViewToTerminal() {
+        int rows, cols;
+        if (terminalSize(rows, cols)) {
+            viewWidth = max(1, min(cols, VIEW_MAX_WIDTH));
+            viewHeight = max(1, min(rows - STATUS_LINES - (hudVisible ? HUD_LINES : 0), VIEW_MAX_HEIGHT));
+        }
+        screenVersion++;
+    }
+
+    // Function to build the frame: rebuilds the rows of the view that changed since the frame was last built
+    // and writes the status lines. Only the cells and entities in view are visited, so the cost does not
+    // depend on the size of the board.
+    void buildFrame(Frame& frame) const {
+        // A scrolled or resized view shows other cells on every row
+        bool moved = !frame.built || frame.viewX != viewX || frame.viewY != viewY ||
+                     frame.width != viewWidth || frame.height != viewHeight;
+        frame.viewX = viewX;
+        frame.viewY = viewY;
+        frame.width = viewWidth;
+        frame.height = viewHeight;
+        frame.screenVersion = screenVersion;
+        frame.measured = hudVisible;
+        frame.inputSequence = inputSequence;
+        frame.inputTime = inputTime;
+
+        // Build every changed row as a line of cells with the attributes already applied
+        bool changed[VIEW_MAX_HEIGHT];
+        for (int i = 0; i < viewHeight; i++) {
+            int y = viewY + i;
+            changed[i] = moved || frame.rowVersion[i] != rowVersion[y];
+            if (!changed[i]) {
+                continue;
+            }
+            frame.rowVersion[i] = rowVersion[y];
+            chtype* row = frame.rows[i];
+            for (int j = 0; j < viewWidth; j++) {
+                Entity* tile = grid[y][viewX + j];
+                if (!tile) {
+                    row[j] = ' ';
+                } else if (tile->getSymbol() == DESTRUCTIBLE_BLOCK && static_cast<DestructibleBlock*>(tile)->isGreenBlock()) {
+                    // The green block hides the exit door
+                    row[j] = tile->getSymbol() | COLOR_PAIR(PAIR_EXIT_BLOCK);
+                } else {
+                    row[j] = tile->getSymbol();
+                }
+            }
+        }
+        frame.built = true;
+
+        // Entities are drawn over the tiles of the rows being rebuilt; the enemies come from
+        // the spatial index chunks that overlap the view
+        auto overlay = [&](const Entity* entity, chtype symbol) {
+            int i = entity->getY() - viewY, j = entity->getX() - viewX;
+            if (i >= 0 && i < viewHeight && j >= 0 && j < viewWidth && changed[i]) {
+                frame.rows[i][j] = symbol;
+            }
+        };
+        // The other players of a network game show as their player number
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if (players[k] && players[k]->isAlive()) {
+                overlay(players[k], k == localSlot ? PLAYER : '1' + k);
+            }
+        }
+        for (int cy = viewY / CHUNK_SIZE; cy <= (viewY + viewHeight - 1) / CHUNK_SIZE; cy++) {
+            for (int cx = viewX / CHUNK_SIZE; cx <= (viewX + viewWidth - 1) / CHUNK_SIZE; cx++) {
+                for (const Enemy* enemy : enemyChunks[cy * CHUNK_COLS + cx]) {
+                    overlay(enemy, enemy->getSymbol());
+                }
+            }
+        }
+        for (int i = 0; i < bombCount; i++) {
+            overlay(bombs[i], bombs[i]->getSymbol());
+        }
+        if (exitDoor->isVisible()) {
+            overlay(exitDoor, exitDoor->getSymbol());
+        }
+
+        // Status lines
+        char text[STATUS_WIDTH + 1];
+        frame.clearStatus();
+        if (levelPack) {
+            snprintf(text, sizeof(text), "Bombs planted: %-4d Level %d/%d %s", bombsPlanted, currentLevel + 1,
+                     levelPack->getLevelCount(), levelPack->getLevelName(currentLevel).c_str());
+        } else {
+            snprintf(text, sizeof(text), "Bombs planted: %-4d Level %d", bombsPlanted, currentLevel + 1);
+        }
+        frame.print(0, 0, text);
+        if (onlineSlots) {
+            snprintf(text, sizeof(text), "Online as player %d of %d", localSlot + 1, __builtin_popcount(onlineSlots));
+            frame.print(0, 48, text);
+        } else if (lastHandoffMicros >= 0) {
+            snprintf(text, sizeof(text), "Ready in %ld us (max %ld us)", lastHandoffMicros, maxHandoffMicros);
+            frame.print(0, 48, text);
+        }
+        if (tick < noticeUntil) {
+            frame.print(1, 0, notice.c_str());
+        } else if (saveWriter.hasSaved()) {
+            if (saveWriter.isSaving()) {
+                frame.print(1, 0, "Saving game...");
+            } else if (saveWriter.lastSaveFailed()) {
+                frame.print(1, 0, "Unable to save game!");
+            } else {
+                // Compression ratio and throughput of the tile section of the last checkpoint
+                double ratio = lastTileBytes ? (double)(WIDTH * HEIGHT) / lastTileBytes : 0;
+                double mbPerSecond = (double)(WIDTH * HEIGHT) / max(1L, lastSerializeMicros);
+                snprintf(text, sizeof(text), "Game saved successfully! Tiles %d -> %zu bytes (%.1fx, %.0f MB/s)",
+                         WIDTH * HEIGHT, lastTileBytes, ratio, mbPerSecond);
+                frame.print(1, 0, text);
+            }
+        }
+        frame.statusLines = STATUS_LINES;
+        if (hudVisible) {
+            frame.statusLines += HUD_LINES;
+            printHud(frame);
+        }
+    }
+
+    // Function to write the performance HUD under the status lines: percentiles in milliseconds
+    // over the last HUD_WINDOW samples
+    void printHud(Frame& frame) const {
+        char text[STATUS_WIDTH + 1];
+        const char* names[] = {"Tick  ", "Render", "Input "};
+        const SampleWindow* windows[] = {&tickTimes, &presenter.getRenderTimes(), &presenter.getInputLatency()};
+        for (int i = 0; i < HUD_LINES; i++) {
+            uint32_t p50, p99, maximum;
+            if (windows[i]->summarize(p50, p99, maximum)) {
+                snprintf(text, sizeof(text), "%s p50 %6.2f  p99 %6.2f  max %6.2f ms", names[i], p50 / 1000.0,
+                         p99 / 1000.0, maximum / 1000.0);
+            } else {
+                snprintf(text, sizeof(text), "%s -", names[i]);
+            }
+            frame.print(STATUS_LINES + i, 0, text);
+        }
+        uint32_t p50, p99, maximum;
+        if (tickAllocations.summarize(p50, p99, maximum)) {
+            snprintf(text, sizeof(text), "Allocs/frame %u (max %u)", p50, maximum);
+            frame.print(STATUS_LINES, 50, text);
+        }
+        snprintf(text, sizeof(text), "Enemies %d", enemyCount);
+        frame.print(STATUS_LINES + 1, 50, text);
+        snprintf(text, sizeof(text), "Bombs %d", bombCount);
+        frame.print(STATUS_LINES + 2, 50, text);
+        if (rollbackTimes.summarize(p50, p99, maximum)) {
+            snprintf(text, sizeof(text), "Rollback %.2f ms", maximum / 1000.0);
+            frame.print(STATUS_LINES + 1, 64, text);
+        }
+    }
+
+    // Function to show or hide the performance HUD
+    void toggleHud() {
+        hudVisible = !hudVisible;
+        fitViewToTerminal();
+    }
+
+    // Function to display the game: publish a frame for the render thread (or draw it here if it is not running).
+    // Nothing is published when the frame looks the same as the last one.
+    void display() {
+        followPlayer();
+        buildFrame(presenter.back());
+        if (!published.update(presenter.back())) {
+            return;
+        }
+        session.record(tick, presenter.back());
+        presenter.publish();
+        if (!presenter.isRunning()) {
+            presenter.drawNow(renderer);
+        }
+    }
+
+    // Function to check if a move is valid
+    // Enemies can step on the traps
+    // But if the player steps on it the game is over
+    bool isValidMove(int x, int y) {
+        return x > 0 && x < WIDTH - 1 && y > 0 && y < HEIGHT - 1 && grid[y][x] == nullptr || grid[y][x]->getSymbol() == TRAP;
+    }
+
+    // Function to move the player in a slot, given the change in x and y; in the game grid
+    void movePlayer(int slot, int dx, int dy) {
+        Player* player = players[slot];
+        int newX = player->getX() + dx;
+        int newY = player->getY() + dy;
+
+        if (isValidMove(newX, newY)) {
+            touchRow(player->getY());
+            player->move(dx, dy);
+            player->setChangedTick(changeTick());
+            touchRow(newY);
+            if (slot == 0) {
+                journal.playerMove(newX, newY);
+            }
+            // Walking into an enemy
+            for (int i = 0; i < enemyCount; i++) {
+                if (enemies[i]->getX() == newX && enemies[i]->getY() == newY) {
+                    playersCaught |= 1u << slot;
+                }
+            }
+        }
+    }
+
+    // Function to plant a bomb where the player in a slot stands
+    void plantBomb(int slot) {
+        Player* player = players[slot];
+        if (player->canPlantBomb()) {
+            if (bombCount >= MAX_BOMBS) {
+                return;
+            }
+            addBomb(new Bomb(player->getX(), player->getY(), slot));
+            touchRow(player->getY());
+            journal.bombPlant(player->getX(), player->getY());
+            player->useBomb();
+            player->setChangedTick(changeTick());
+            bombsPlanted++;
+        }
+    }
+
+    // Function to take the player in a slot off the board; the game is over once nobody is left,
+    // so a single player game ends with the first death
+    void killPlayer(int slot, const string& causeOfDeath) {
+        players[slot]->setAlive(false);
+        players[slot]->setChangedTick(changeTick());
+        touchRow(players[slot]->getY());
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if (players[k] && players[k]->isAlive()) {
+                return;
+            }
+        }
+        gameOver(causeOfDeath);
+    }
+
+    // Function to explode a bomb
+    void explodeBomb(Bomb* bomb) {
+        int bx = bomb->getX(), by = bomb->getY();
+        // The blast can only reach rows within 3 tiles of the bomb
+        for (int y = by - 3; y <= by + 3; y++) {
+            touchRow(y);
+        }
+        // Explode in all 4 directions
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                if (dx == 0 || dy == 0) { // Only explode in straight lines
+                    for (int i = 1; i <= 3; i++) { // Explode up to 3 blocks away
+                        int x = bx + dx * i, y = by + dy * i;
                         if (x < 0 || x >= WIDTH || y < 0 || y >= HEIGHT) break;
                         
                         // Check for block destruction
                         if (grid[y][x] && grid[y][x]->getSymbol() == DESTRUCTIBLE_BLOCK) {
                             delete grid[y][x];
                             grid[y][x] = nullptr;
+                            connectivity->openCell(x, y);
+                            stampTile(x, y);
+                            journal.tile(x, y, ' ');
                             if (x == exitDoor->getX() && y == exitDoor->getY()) {
                                 exitDoor->setVisible(true);
+                                journal.exitVisible();
                             }
                             break;
                         } else if (grid[y][x] && grid[y][x]->getSymbol() == INDESTRUCTIBLE_BLOCK) {
                             break;
                         }
 
-                        // Check for enemy elimination
-                        for (int j = 0; j < enemyCount; j++) {
-                            if (enemies[j]->getX() == x && enemies[j]->getY() == y) {
-                                delete enemies[j];
-                                enemies[j] = enemies[--enemyCount];
-                                break;
-                            }
-                        }
+                        // Check for enemy elimination
+                        for (int j = 0; j < enemyCount; j++) {
+                            if (enemies[j]->getX() == x && enemies[j]->getY() == y) {
+                                removeEnemy(j);
+                                break;
+                            }
+                        }
+
+                        // Check for player elimination
+                        for (int k = 0; k < MAX_PLAYERS; k++) {
+                            if (players[k] && players[k]->isAlive() && players[k]->getX() == x && players[k]->getY() == y) {
+                                // Handling player death
+                                killPlayer(k, "Player was blown up by a bomb!");
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        // Reload the bomb of the player who planted it
+        if (players[bomb->getOwner()]) {
+            players[bomb->getOwner()]->reloadBomb();
+            players[bomb->getOwner()]->setChangedTick(changeTick());
+        }
+    }
+
+    // Function to update the game state
+    void update() {
+        // Player and enemy collision; flagged when either of them steps onto the other
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if ((playersCaught >> k & 1) && players[k]->isAlive()) {
+                killPlayer(k, "Player was caught by an enemy!");
+            }
+        }
+        playersCaught = 0;
+        if (finished) {
+            return;
+        }
+
+        // Player and trap collision
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            Player* player = players[k];
+            if (player && player->isAlive() && grid[player->getY()][player->getX()] &&
+                grid[player->getY()][player->getX()]->getSymbol() == TRAP) {
+                killPlayer(k, "Player stepped on a trap!");
+            }
+        }
+        if (finished) {
+            return;
+        }
+
+        // Enemy movement, one archetype bucket at a time
+        EnemyContext ctx = {grid, {}, {}, bombs, bombCount, &random};
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            bool live = players[k] && players[k]->isAlive();
+            ctx.playerX[k] = live ? players[k]->getX() : -1;
+            ctx.playerY[k] = live ? players[k]->getY() : -1;
+        }
+        uint64_t randomBefore = random.getState();
+        updateBucket<HorizontalBehaviour>(ctx);
+        updateBucket<VerticalBehaviour>(ctx);
+        updateBucket<WandererBehaviour>(ctx);
+        updateBucket<ChaserBehaviour>(ctx);
+        updateBucket<PatrollerBehaviour>(ctx);
+        updateBucket<WallHuggerBehaviour>(ctx);
+        updateBucket<BombAvoiderBehaviour>(ctx);
+        if (random.getState() != randomBefore) {
+            randomChanged = changeTick();
+        }
+        tick++;
+
+        // Bomb explosion
+        int i = 0;
+        while (i < bombCount) {
+            // Check if the bomb should explode
+            // The fuse keeps burning, so the bomb's row changes every tick
+            touchRow(bombs[i]->getY());
+            bombs[i]->burn();
+            if (bombs[i]->shouldExplode()) {
+                explodeBomb(bombs[i]);
+                removeBomb(i);
+            } else {
+                i++;
+            }
+        }
+
+        // Check for level completion; in a network game one player reaching the exit is enough
+        for (int k = 0; k < MAX_PLAYERS && exitDoor->isVisible(); k++) {
+            Player* player = players[k];
+            if (player && player->isAlive() && player->getX() == exitDoor->getX() && player->getY() == exitDoor->getY()) {
+                // Handle level completion
+                gameWin();
+                return;
+            }
+        }
+    }
+
+    // Function to run the game
+    void run() {
+        initscr();
+        cbreak();
+        noecho();
+        keypad(stdscr, TRUE);
+        curs_set(0);
+
+        while (true) {
+            displayMenu();
+            int choice = getch() - '0';
+
+            // Start a new game
+            switch (choice) {
+                case 1:
+                    saveIndex.load(indexPath());
+                    selectSlot(saveIndex.pickSlotForNewGame());
+                    if (levelPack && !enterLevel(0)) {
+                        mvprintw(LINES / 2 + 2, COLS / 2 - 15, "%s. Press any key to continue.", loadError.c_str());
+                        refresh();
+                        getch();
+                        break;
+                    }
+                    // Replays hold a seed, so only random boards are recorded
+                    if (!replayFileName.empty() && !levelPack) {
+                        replay.start(replayFileName, seed);
+                    }
+                    playGame();
+                    break;
+                case 2: {
+                    int slot = displaySlotBrowser();
+                    if (slot == -2) {
+                        break;
+                    }
+                    selectSlot(slot);
+                    loadError.clear();
+                    if (loadGame()) {
+                        playGame();
+                    } else if (!loadError.empty()) {
+                        mvprintw(LINES / 2 + 2, COLS / 2 - 15, "Saved game is damaged. Press any key to continue.");
+                        mvprintw(LINES / 2 + 3, COLS / 2 - 15, "%s", loadError.c_str());
+                        refresh();
+                        getch();
+                    } else {
+                        mvprintw(LINES / 2 + 2, COLS / 2 - 15, "No saved game found. Press any key to continue.");
+                        refresh();
+                        getch();
+                    }
+                    break;
+                }
+                case 3:
+                    saveWriter.flush();
+                    endwin();
+                    exit(0);
+                default:
+                    break;
+            }
+        }
+    }
+
+
+    // Function to handle a key pressed during the game; actions apply to the current tick
+    void handleKey(int ch) {
+        inputSequence++;
+        inputTime = chrono::steady_clock::now();
+
+        int action = actionForKey(ch);
+        if (action != ACTION_NONE) {
+            replay.input(tick, action);
+            applyAction(action);
+        }
+        switch (ch) {
+            case 'e': saveGame(); break;
+            case 'x': exportGame(); break;
+            case KEY_RESIZE: fitViewToTerminal(); break;
+            case 'h': case 'H': toggleHud(); break;
+            case 'q': case 'Q':{
+                if (replay.isActive()) {
+                    replay.finish(tick, false, stateHash());
+                }
+                presenter.stop();
+                session.finish();
+                saveWriter.flush();
+                endwin();
+                exit(0);
+            };
+        }
+    }
+
+    // Function to run one tick of the game
+    void runTick() {
+        bool measured = hudVisible;
+        auto tickStart = measured ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+        unsigned long allocationsBefore = measured ? allocationCount.load(memory_order_relaxed) : 0;
+
+        update();
+        saveWriter.poll();
+        bool exported;
+        if (exportJob && saveWriter.takeOutcome(exportJob, exported)) {
+            notice = exported ? "Game exported to " + saveFileName : "Unable to export game!";
+            noticeUntil = tick + 40;
+            exportJob = 0;
+        }
+        if (replay.isActive() && tick % REPLAY_HASH_TICKS == 0) {
+            replay.hash(tick, stateHash());
+        }
+        // Periodic autosave
+        if (tick % AUTOSAVE_TICKS == 0) {
+            saveGame();
+        }
+        if (tickListener) {
+            tickListener(*this);
+        }
+        if (measured) {
+            tickTimes.add(microsSince(tickStart));
+            tickAllocations.add(allocationCount.load(memory_order_relaxed) - allocationsBefore);
+        }
+    }
+
+    // Function to find the next tick that can change anything (or has to run on time): the ticks before it
+    // only count up, so the game loop can sleep through them
+    unsigned long nextBusyTick() const {
+        // Every tick matters while a bomb burns, a save or export is written, the HUD is shown or
+        // observations are published, and right after a key (the update checks what the player stepped on)
+        if (bombCount > 0 || playersCaught || hudVisible || tickListener || keyTick == tick ||
+            saveWriter.isSaving() || saveWriter.needsPoll() || exportJob) {
+            return tick;
+        }
+        // The autosave and the replay hash run in the tick that ends on a multiple of their period
+        unsigned long due = tick + AUTOSAVE_TICKS - 1 - tick % AUTOSAVE_TICKS;
+        if (replay.isActive()) {
+            due = min(due, tick + REPLAY_HASH_TICKS - 1 - tick % REPLAY_HASH_TICKS);
+        }
+        if (tick < noticeUntil) {
+            due = min(due, noticeUntil - 1);
+        }
+        // The first scheduler slot with an enemy in it
+        for (unsigned long t = tick; t < due && t < tick + SCHEDULE_SLOTS; t++) {
+            for (int type = 0; type < NUM_ENEMY_TYPES; type++) {
+                if (!schedule[type][t % SCHEDULE_SLOTS].empty()) {
+                    return t;
+                }
+            }
+        }
+        return due;
+    }
+
+    // Function to play the game
+    void playGame() {
+        nodelay(stdscr, TRUE);
+        refresh();
+        KeyInput::watchResize();
+        fitViewToTerminal();
+        if (!sessionFileName.empty() && !session.isActive()) {
+            session.start(sessionFileName);
+        }
+        presenter.start(renderer);
+        preloadNextLevel();
+
+        // Tick t is due at clockStart + (t - clockTick) * TICK_MS, so the time spent on a tick does not stretch it.
+        // Between ticks the loop sleeps until a key arrives or the next tick that has something to do;
+        // the idle ticks slept through are run (cheaply) on waking, so the game advances exactly as before.
+        auto clockStart = chrono::steady_clock::now();
+        unsigned long clockTick = tick;
+        auto tickTime = [&](unsigned long t) {
+            return clockStart + chrono::milliseconds(((long)t - (long)clockTick) * TICK_MS);
+        };
+        while (true) {
+            display();
+
+            unsigned long due = nextBusyTick();
+            if (keyTick == tick) {
+                // A key was handled on this tick already; the next one waits for the next tick
+                this_thread::sleep_until(tickTime(due));
+            } else {
+                keyInput.wait(tickTime(due));
+            }
+
+            auto now = chrono::steady_clock::now();
+            if (now > tickTime(due) + chrono::milliseconds(TICK_MS)) {
+                // Woke up too late (e.g. the process was stopped): run the due tick now rather than
+                // catching up on the ticks missed after it in a burst
+                clockStart = now;
+                clockTick = due;
+            }
+            while (now >= tickTime(tick)) {
+                runTick();
+            }
+            if (keyTick != tick) {
+                int ch = keyInput.next();
+                if (ch != ERR) {
+                    keyTick = tick;
+                    handleKey(ch);
+                }
+            }
+        }
+    }
+
+    // Function to play a network game: the server runs the game, this terminal sends the actions of its player
+    // and applies the states it gets back to a copy of the server's game (confirmed), acknowledging each batch
+    // of them so the next ones can build on it. What is drawn is this game, a prediction that runs on the local
+    // clock up to NET_ROLLBACK_TICKS ahead of the confirmed one and applies the player's keys straight away;
+    // every batch of states rolls it back and runs it forward again (see predict).
+    // Returns the exit status once Q is pressed or the connection ends.
+    int playOnline(NetConnection& server) {
+        initscr();
+        cbreak();
+        noecho();
+        keypad(stdscr, TRUE);
+        curs_set(0);
+        nodelay(stdscr, TRUE);
+        refresh();
+        KeyInput::watchResize();
+        fitViewToTerminal();
+        presenter.start(renderer);
+
+        // The payload buffer is allocated once; a state is copied into it straight from the connection's ring
+        vector<unsigned char> payload(NET_STATE_RING);
+        unique_ptr<Game> confirmed(new Game(0));
+        confirmed->setHeadless(true);
+        headless = predicted = true;
+        vector<PredictedInput> inputs;      // Sent, and not acknowledged by the confirmed game yet
+        inputs.reserve(NET_INPUT_QUEUE);
+        bool joined = false;        // Nothing is drawn before the first state replaces the local board
+        uint32_t sequence = 0;
+        string error;
+        bool quit = false;
+
+        // Predicted tick t is due at clockStart + (t - clockTick) * TICK_MS; the clock is set again whenever
+        // the prediction has to wait for the server or falls behind it
+        auto clockStart = chrono::steady_clock::now();
+        unsigned long clockTick = 0;
+        auto tickTime = [&](unsigned long t) {
+            return clockStart + chrono::milliseconds(((long)t - (long)clockTick) * TICK_MS);
+        };
+        while (!quit && error.empty()) {
+            if (joined) {
+                display();
+            }
+            timespec timeout = {0, 0};
+            if (joined) {
+                auto wait = chrono::duration_cast<chrono::milliseconds>(tickTime(tick + 1) - chrono::steady_clock::now());
+                int millis = max(0, (int)wait.count() + 1);
+                timeout = {(time_t)(millis / 1000), (long)(millis % 1000) * 1000000L};
+            }
+            pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {server.getFd(), (short)(POLLIN | (server.hasPending() ? POLLOUT : 0)), 0}};
+            KeyInput::pollResizable(fds, 2, joined ? &timeout : nullptr);
+
+            bool open = server.receive();
+            NetHeader header;
+            bool applied = false;
+            while (error.empty() && server.next(header, payload.data(), payload.size())) {
+                if (header.type == NET_WELCOME && header.size == sizeof(NetWelcome)) {
+                    NetWelcome welcome;
+                    memcpy(&welcome, payload.data(), sizeof(welcome));
+                    if (welcome.slot >= MAX_PLAYERS || welcome.width != WIDTH || welcome.height != HEIGHT) {
+                        error = "The server plays on a board of another size";
+                    }
+                    localSlot = welcome.slot;
+                } else if (header.type == NET_STATE) {
+                    if (!confirmed->applyDelta(payload.data(), header.size)) {
+                        error = "The server sent a damaged state";
+                    }
+                    applied = true;
+                } else if (header.type == NET_END) {
+                    // Shown for the first 3 seconds of the next game (its ticks count from 0 again)
+                    notice.assign((const char*)payload.data(), header.size);
+                    notice += " A new game starts.";
+                    noticeUntil = 60;
+                } else if (header.type == NET_FULL) {
+                    error = "The game is full";
+                }
+            }
+            if (applied && error.empty()) {
+                NetAck ack = {confirmed->getStateEpoch(), (uint32_t)confirmed->getTick()};
+                server.send(NET_ACK, &ack, sizeof(ack));
+                // Roll back and catch up again; a new board, or a server that got ahead, starts the clock over
+                unsigned long target = min(tick, confirmed->getTick() + NET_ROLLBACK_TICKS);
+                if (!joined || confirmed->getStateEpoch() != stateEpoch || confirmed->getTick() > tick) {
+                    target = clockTick = confirmed->getTick();
+                    clockStart = chrono::steady_clock::now();
+                }
+                auto rollbackStart = chrono::steady_clock::now();
+                predict(*confirmed, inputs, target);
+                if (hudVisible) {
+                    rollbackTimes.add(microsSince(rollbackStart));
+                }
+                joined = true;
+            }
+            if (server.isBroken()) {
+                error = "The server sent a message that is too large";
+            } else if (!open && error.empty()) {
+                error = "The server closed the connection";
+            }
+
+            // The ticks of the local clock; the prediction stops where a rollback would no longer fit in a frame
+            auto now = chrono::steady_clock::now();
+            while (joined && now >= tickTime(tick + 1)) {
+                if (finished || tick >= confirmed->getTick() + NET_ROLLBACK_TICKS) {
+                    clockStart = now;
+                    clockTick = tick;
+                    break;
+                }
+                predictTick(inputs);
+            }
+
+            int ch;
+            while ((ch = keyInput.next()) != ERR) {
+                inputSequence++;
+                inputTime = chrono::steady_clock::now();
+                int action = actionForKey(ch);
+                if (action != ACTION_NONE) {
+                    NetInput input = {++sequence, (uint32_t)action};
+                    server.send(NET_INPUT, &input, sizeof(input));
+                    // One action per tick, as the server takes them; the server drops what does not fit its queue
+                    if (inputs.size() == NET_INPUT_QUEUE) {
+                        inputs.erase(inputs.begin());
+                    }
+                    unsigned long due = inputs.empty() ? tick : max(tick, inputs.back().tick + 1);
+                    inputs.push_back({input.sequence, action, due});
+                    if (joined && due == tick) {
+                        applyAction(action, localSlot);
+                        setLastInput(localSlot, input.sequence);
+                    }
+                }
+                switch (ch) {
+                    case KEY_RESIZE: fitViewToTerminal(); break;
+                    case 'h': case 'H': toggleHud(); break;
+                    case 'q': case 'Q': quit = true; break;
+                }
+            }
+            if (!server.flush() && error.empty()) {
+                error = "The connection to the server was lost";
+            }
+        }
+        presenter.stop();
+        endwin();
+        if (!error.empty()) {
+            cerr << error << endl;
+            return 1;
+        }
+        return 0;
+    }
+};
+
+/*
+-------------------------------------------------- Observation Encoder Class --------------------------------------------------
+*/
+
+// The observation encoder writes the board as a stack of planes straight into a caller supplied buffer,
+// so other processes (training, analytics) can read the live state without parsing the text save.
+//
+// Layout: plane-major, then row-major.
+//  - OBS_BITS:  every row is OBS_ROW_WORDS 64-bit words, bit j of the row is column j
+//  - OBS_BYTES: every row is OBS_ROW_BYTES bytes (WIDTH padded to 16 for SIMD loads), one byte per column
+// In byte mode the fuse plane holds the time left on the bomb in tenths of a second,
+// in bit mode it marks bombs that explode within the next second.
+
+#define OBS_ROW_WORDS ((WIDTH + 63) / 64)
+#define OBS_ROW_BYTES ((WIDTH + 15) / 16 * 16)
+
+enum ObservationPlane {
+    PLANE_WALL,     // Indestructible blocks
+    PLANE_BLOCK,    // Destructible blocks (including the green one)
+    PLANE_TRAP,
+    PLANE_BOMB,
+    PLANE_FUSE,
+    PLANE_ENEMY,
+    PLANE_PLAYER,
+    PLANE_DOOR,     // Only once the exit door is visible
+    NUM_PLANES
+};
+
+enum ObservationFormat {
+    OBS_BITS,
+    OBS_BYTES
+};
+
+class ObservationEncoder {
+private:
+    ObservationFormat format;
+    unsigned char* buffer;          // Destination buffer (owned by the caller)
+    unsigned seenVersion[HEIGHT];   // Row versions at the time of the last encode
+    bool primed;                    // Whether the buffer holds a complete encode yet
+
+    // Plane of each static grid symbol; NUM_PLANES for symbols that are not encoded
+    static int planeOf(char symbol) {
+        switch (symbol) {
+            case INDESTRUCTIBLE_BLOCK: return PLANE_WALL;
+            case DESTRUCTIBLE_BLOCK: return PLANE_BLOCK;
+            case TRAP: return PLANE_TRAP;
+            default: return NUM_PLANES;
+        }
+    }
+
+    uint64_t* bitRow(int plane, int y) const {
+        return reinterpret_cast<uint64_t*>(buffer) + ((size_t)plane * HEIGHT + y) * OBS_ROW_WORDS;
+    }
+    unsigned char* byteRow(int plane, int y) const {
+        return buffer + ((size_t)plane * HEIGHT + y) * OBS_ROW_BYTES;
+    }
+
+    // Set one cell of a plane
+    void set(int plane, int x, int y, unsigned char value = 1) {
+        if (format == OBS_BITS) {
+            if (value) bitRow(plane, y)[x >> 6] |= 1ull << (x & 63);
+        } else {
+            byteRow(plane, y)[x] = value;
+        }
+    }
+
+    // Rewrite the grid planes of one row; entity planes of the row are cleared
+    void encodeTiles(const Game& game, int y) {
+        if (format == OBS_BITS) {
+            // Build the row in registers first, then store each plane with a single copy
+            uint64_t words[NUM_PLANES + 1][OBS_ROW_WORDS] = {};
+            for (int j = 0; j < WIDTH; j++) {
+                Entity* tile = game.getTile(j, y);
+                int plane = tile ? planeOf(tile->getSymbol()) : NUM_PLANES;
+                words[plane][j >> 6] |= 1ull << (j & 63);
+            }
+            for (int p = 0; p < NUM_PLANES; p++) {
+                memcpy(bitRow(p, y), words[p], sizeof(words[p]));
+            }
+        } else {
+            for (int p = 0; p < NUM_PLANES; p++) {
+                memset(byteRow(p, y), 0, OBS_ROW_BYTES);
+            }
+            for (int j = 0; j < WIDTH; j++) {
+                Entity* tile = game.getTile(j, y);
+                int plane = tile ? planeOf(tile->getSymbol()) : NUM_PLANES;
+                if (plane != NUM_PLANES) byteRow(plane, y)[j] = 1;
+            }
+        }
+    }
+
+public:
+    // Number of bytes needed for one encoded board
+    static size_t requiredSize(ObservationFormat format) {
+        return format == OBS_BITS ? (size_t)NUM_PLANES * HEIGHT * OBS_ROW_WORDS * sizeof(uint64_t)
+                                  : (size_t)NUM_PLANES * HEIGHT * OBS_ROW_BYTES;
+    }
+
+    // Constructor; the buffer must be at least requiredSize(format) bytes and 8-byte aligned
+    ObservationEncoder(ObservationFormat format, void* buffer)
+        : format(format), buffer(static_cast<unsigned char*>(buffer)), primed(false) {
+        memset(seenVersion, 0, sizeof(seenVersion));
+    }
+
+    // Force the next encode() to rewrite every row
+    void invalidate() { primed = false; }
+
+    // Encode the rows that changed since the last call; returns the number of rows written
+    int encode(const Game& game) {
+        bool changed[HEIGHT];
+        int changedCount = 0;
+        for (int i = 0; i < HEIGHT; i++) {
+            changed[i] = !primed || game.getRowVersion(i) != seenVersion[i];
+            if (changed[i]) {
+                seenVersion[i] = game.getRowVersion(i);
+                encodeTiles(game, i);
+                changedCount++;
+            }
+        }
+        primed = true;
+        if (changedCount == 0) {
+            return 0;
+        }
+
+        // A single pass over the entities fills in the rows that were rewritten
+        const Player* player = game.getPlayer();
+        if (changed[player->getY()]) {
+            set(PLANE_PLAYER, player->getX(), player->getY());
+        }
+        for (int i = 0; i < game.getEnemyCount(); i++) {
+            const Enemy* enemy = game.getEnemy(i);
+            if (changed[enemy->getY()]) {
+                set(PLANE_ENEMY, enemy->getX(), enemy->getY());
+            }
+        }
+        for (int i = 0; i < game.getBombCount(); i++) {
+            const Bomb* bomb = game.getBomb(i);
+            if (changed[bomb->getY()]) {
+                int fuse = bomb->fuseRemainingMs();
+                set(PLANE_BOMB, bomb->getX(), bomb->getY());
+                set(PLANE_FUSE, bomb->getX(), bomb->getY(),
+                    format == OBS_BITS ? fuse <= 1000 : (unsigned char)((fuse + 99) / 100));
+            }
+        }
+        const ExitDoor* door = game.getExitDoor();
+        if (door->isVisible() && changed[door->getY()]) {
+            set(PLANE_DOOR, door->getX(), door->getY());
+        }
+        return changedCount;
+    }
+};
+
+/*
+-------------------------------------------------- Shared Observation Class --------------------------------------------------
+*/
+
+// Publishes the encoded board in a POSIX shared memory segment (/dev/shm/<name>).
+// A reader copies the planes while the sequence number is even and unchanged before and after the copy
+// (a seqlock), so the game never waits for readers.
 
-                        // Check for player elimination
-                        if (player->getX() == x && player->getY() == y) {
-                            // Handling player death
-                            gameOver("Player was blown up by a bomb!");
-                        }
-                    }
-                }
+#define OBS_MAGIC 0x534F4D42    // "BMOS"
+#define OBS_VERSION 1
+
+struct ObservationHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t planes;
+    uint32_t format;                // ObservationFormat
+    atomic<uint64_t> sequence;      // Odd while the game is writing
+    uint64_t frames;                // Number of boards published so far
+    uint64_t payloadOffset;         // Offset of the planes from the start of the segment
+};
+
+class SharedObservation {
+private:
+    string name;
+    void* segment;
+    size_t segmentSize;
+    ObservationHeader* header;
+    ObservationEncoder* encoder;
+
+public:
+    // Constructor; creates (or reuses) the shared memory segment
+    SharedObservation(const string& name, ObservationFormat format)
+        : name(name), segment(MAP_FAILED), segmentSize(0), header(nullptr), encoder(nullptr) {
+        size_t payloadOffset = (sizeof(ObservationHeader) + 63) / 64 * 64;
+        segmentSize = payloadOffset + ObservationEncoder::requiredSize(format);
+
+        int fd = shm_open(this->name.c_str(), O_CREAT | O_RDWR, 0600);
+        if (fd < 0) {
+            return;
+        }
+        if (ftruncate(fd, segmentSize) == 0) {
+            segment = mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (segment == MAP_FAILED) {
+            return;
+        }
+
+        header = new (segment) ObservationHeader();
+        header->magic = OBS_MAGIC;
+        header->version = OBS_VERSION;
+        header->width = WIDTH;
+        header->height = HEIGHT;
+        header->planes = NUM_PLANES;
+        header->format = format;
+        header->sequence.store(0, memory_order_relaxed);
+        header->frames = 0;
+        header->payloadOffset = payloadOffset;
+        encoder = new ObservationEncoder(format, static_cast<char*>(segment) + payloadOffset);
+    }
+
+    // Destructor; the segment stays in /dev/shm until it is unlinked
+    ~SharedObservation() {
+        delete encoder;
+        if (segment != MAP_FAILED) {
+            munmap(segment, segmentSize);
+        }
+    }
+
+    bool isOpen() const { return encoder != nullptr; }
+
+    // Encode the changed rows of the board into the segment
+    void publish(const Game& game) {
+        if (!encoder) {
+            return;
+        }
+        uint64_t seq = header->sequence.load(memory_order_relaxed);
+        header->sequence.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        encoder->encode(game);
+        header->frames++;
+        header->sequence.store(seq + 2, memory_order_release);
+    }
+
+    // Remove the segment name (readers that already mapped it keep their mapping)
+    void unlink() {
+        shm_unlink(name.c_str());
+    }
+};
+
+/*
+-------------------------------------------------- Session Playback --------------------------------------------------
+*/
+
+static volatile sig_atomic_t playbackStopped = 0;
+
+static void stopPlayback(int) {
+    playbackStopped = 1;
+}
+
+// Copy the screen of a session into a frame for the renderer
+static void sessionFrame(const SessionReader& reader, Frame& frame) {
+    if (frame.width != reader.getWidth() || frame.height != reader.getHeight() ||
+        frame.statusLines != reader.getStatusLines()) {
+        frame.width = reader.getWidth();
+        frame.height = reader.getHeight();
+        frame.statusLines = reader.getStatusLines();
+        frame.screenVersion++;
+    }
+    for (int i = 0; i < frame.height; i++) {
+        for (int j = 0; j < frame.width; j++) {
+            uint16_t cell = reader.getCell(i, j);
+            frame.rows[i][j] = (cell & 0xFF) | COLOR_PAIR(cell >> 8);
+        }
+        frame.rowVersion[i]++;
+    }
+    frame.clearStatus();
+    for (int i = 0; i < frame.statusLines; i++) {
+        for (int j = 0; j < STATUS_WIDTH; j++) {
+            frame.status[i][j] = (char)reader.getCell(frame.height + i, j);
+        }
+    }
+    frame.built = true;
+}
+
+// Watch a session recording in the terminal at the speed it was recorded, starting the given number
+// of seconds in. The start is found through the keyframe index, so seeking costs the same anywhere
+// in the recording. Ctrl-C stops the playback.
+int playSession(const string& path, double seekSeconds) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        cerr << "Cannot read session " << path << endl;
+        if (fd >= 0) close(fd);
+        return 2;
+    }
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        cerr << "Cannot map session " << path << endl;
+        return 2;
+    }
+
+    SessionReader reader(static_cast<const unsigned char*>(mapped), info.st_size);
+    auto start = chrono::steady_clock::now();
+    unsigned long target = reader.firstTick() + (unsigned long)(max(0.0, seekSeconds) * 1000 / TICK_MS);
+    int decoded = reader.seek(target);
+    long seekMicros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    if (!reader.isValid() || decoded == 0) {
+        cerr << "Bad session " << path << ": " << (reader.isValid() ? "no frames" : reader.getError()) << endl;
+        munmap(mapped, info.st_size);
+        return 2;
+    }
+
+    signal(SIGINT, stopPlayback);
+    unique_ptr<Frame> frame(new Frame());
+    AnsiRenderer renderer(STDOUT_FILENO);
+    auto base = chrono::steady_clock::now();
+    unsigned long baseTick = reader.getTick();
+    unsigned long upcoming;
+    while (!playbackStopped) {
+        sessionFrame(reader, *frame);
+        renderer.draw(*frame);
+        if (!reader.peekTick(upcoming)) {
+            break;
+        }
+        // Wait for the next frame in short steps, so Ctrl-C is noticed
+        auto due = base + chrono::milliseconds((upcoming - baseTick) * TICK_MS);
+        while (!playbackStopped && chrono::steady_clock::now() < due) {
+            this_thread::sleep_until(min(due, chrono::steady_clock::now() + chrono::milliseconds(100)));
+        }
+        if (!reader.next()) {
+            break;
+        }
+    }
+    // Show the cursor again, under the screen
+    printf("\x1b[?25h\x1b[%dH\r\n", frame->height + frame->statusLines);
+    fflush(stdout);
+    cerr << "Started at " << (target - reader.firstTick()) * TICK_MS / 1000.0 << " s: " << decoded
+         << " records decoded in " << seekMicros << " us" << endl;
+    int status = reader.isValid() ? 0 : 1;
+    if (!reader.isValid()) {
+        cerr << "Bad session " << path << ": " << reader.getError() << endl;
+    }
+    munmap(mapped, info.st_size);
+    return status;
+}
+
+/*
+-------------------------------------------------- Replay Playback --------------------------------------------------
+*/
+
+// Re-simulate a recorded game without the terminal and without waiting between ticks,
+// checking the recorded state hashes on the way. Returns 0 if the playback matched the recording.
+int playReplay(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        cerr << "Cannot read replay " << path << endl;
+        if (fd >= 0) close(fd);
+        return 2;
+    }
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        cerr << "Cannot map replay " << path << endl;
+        return 2;
+    }
+
+    ReplayReader reader(static_cast<const unsigned char*>(mapped), info.st_size);
+    int status = 0;
+    if (!reader.isValid()) {
+        cerr << "Bad replay " << path << ": " << reader.getError() << endl;
+        munmap(mapped, info.st_size);
+        return 2;
+    }
+
+    // Games live on the heap: with a large WIDTH and HEIGHT they do not fit on the stack
+    unique_ptr<Game> board(new Game(reader.getSeed()));
+    Game& game = *board;
+    game.setHeadless(true);
+    auto start = chrono::steady_clock::now();
+    int hashesChecked = 0;
+    bool ended = false;
+    ReplayEvent event;
+    bool more = reader.next(event);
+    while (more && status == 0) {
+        if (event.tick < game.getTick() || (game.isFinished() && event.tag != REPLAY_FINISHED)) {
+            cerr << "Replay diverged: the game ended at tick " << game.getTick() << endl;
+            status = 1;
+            break;
+        }
+        if (event.tick > game.getTick()) {
+            game.update();
+            continue;
+        }
+        // Every record of the current tick, in the order they were recorded
+        if (event.tag == REPLAY_HASH) {
+            if (game.stateHash() != event.hash) {
+                cerr << "Replay diverged at tick " << event.tick << endl;
+                status = 1;
+            }
+            hashesChecked++;
+        } else if (event.tag == REPLAY_FINISHED) {
+            // The game may have ended inside the update of this tick
+            if (!game.isFinished()) {
+                game.update();
+            }
+            if (!game.isFinished() || game.getFinishHash() != event.hash) {
+                cerr << "Replay diverged: the game did not end the same way at tick " << event.tick << endl;
+                status = 1;
+            }
+            ended = true;
+        } else if (event.tag == REPLAY_QUIT) {
+            if (game.stateHash() != event.hash) {
+                cerr << "Replay diverged at tick " << event.tick << endl;
+                status = 1;
             }
+            ended = true;
+        } else {
+            game.applyAction(event.tag);
         }
-        // Reload the bomb
-        player->reloadBomb();
+        more = !ended && reader.next(event);
+    }
+    if (status == 0 && !reader.isValid()) {
+        cerr << "Bad replay " << path << ": " << reader.getError() << endl;
+        status = 2;
     }
 
-    // Function to update the game state
-    void update() {
-        // Player and enemy collision
-        for (int i = 0; i < enemyCount; i++) {
-            if (player->getX() == enemies[i]->getX() && player->getY() == enemies[i]->getY()) {
-                gameOver("Player was caught by an enemy!");
+    long micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    if (status == 0) {
+        cout << "Replay matched: " << game.getTick() << " ticks, " << hashesChecked << " state hashes checked in "
+             << micros / 1000.0 << " ms (" << (long)(game.getTick() * 1e6 / max(1L, micros)) << " ticks/s)";
+        if (game.isFinished()) {
+            cout << ". " << game.getResult();
+        }
+        cout << endl;
+    }
+    munmap(mapped, info.st_size);
+    return status;
+}
+
+/*
+-------------------------------------------------- Level Pack Builder --------------------------------------------------
+*/
+
+// Build a level pack from authored levels, written in the text export format (press X in game to export a board)
+int makeLevelPack(const string& path, const vector<string>& levelFiles) {
+    vector<vector<unsigned char>> levels;
+    vector<string> names;
+    unique_ptr<Game> board(new Game());
+    Game& game = *board;
+    game.setHeadless(true);
+    for (const string& file : levelFiles) {
+        vector<unsigned char> image;
+        if (!game.importLevel(file, image)) {
+            cerr << "Cannot import level " << file << (game.getLoadError().empty() ? "" : ": ") << game.getLoadError() << endl;
+            return 1;
+        }
+        levels.push_back(move(image));
+        size_t slash = file.find_last_of('/');
+        string name = file.substr(slash == string::npos ? 0 : slash + 1);
+        names.push_back(name.substr(0, name.find('.')));
+    }
+    if (!LevelPack::write(path, levels, names)) {
+        cerr << "Cannot write " << path << endl;
+        return 1;
+    }
+    cout << "Wrote " << levels.size() << " levels to " << path << endl;
+    return 0;
+}
+
+/*
+-------------------------------------------------- Game Server --------------------------------------------------
+*/
+
+// The server is a single-threaded reactor: one epoll set watches the listening socket, the clients,
+// a timerfd that fires every tick and an eventfd that stops it. A tick applies at most one queued action
+// per player (the same rule as the keys of a local game), updates the game and sends every client the
+// changes since the last state it acknowledged; clients that acknowledged the same state share one encoding.
+// A client whose ring has no room for its state (a stalled connection) skips it, as the next one holds
+// everything it had anyway.
+
+#define NET_TAG_LISTENER MAX_PLAYERS        // epoll tags; the tags below it are the player slots
+#define NET_TAG_TIMER (MAX_PLAYERS + 1)
+#define NET_TAG_WAKE (MAX_PLAYERS + 2)
+
+class GameServer {
+private:
+    // A player slot and the client playing it
+    struct Client {
+        NetConnection connection{NET_INPUT_RING, NET_STATE_RING};
+        bool writing = false;                   // Waiting for the socket to take queued bytes (EPOLLOUT)
+        NetInput queue[NET_INPUT_QUEUE];        // Actions waiting for their tick; more are dropped so a held key cannot build up lag
+        int queueHead = 0, queued = 0;
+        uint32_t ackEpoch = 0;                  // Last state the client applied; epoch 0 before the first one
+        unsigned long ackTick = 0;
+    };
+
+    int listenFd = -1, epollFd = -1, timerFd = -1, wakeFd = -1;
+    Client clients[MAX_PLAYERS];
+    int clientCount = 0;
+    uint64_t seed;                  // Seed of the next game
+    unique_ptr<Game> game;
+    uint32_t epoch = 0;             // Counts the boards (new games and levels); states of an older one are no base
+    int boardLevel = 0;             // Level of the current epoch
+    vector<unsigned char> encoded;  // Last state encoded; keeps its capacity from tick to tick
+    bool stopping = false;
+
+    // Statistics, read by the benchmark while the server runs
+    atomic<unsigned long> statesSent{0}, statesDropped{0}, bytesSent{0};
+    atomic<unsigned long> fullStatesSent{0}, fullBytesSent{0};  // The states that held the whole game
+    atomic<unsigned long> messageAllocations{0};    // Heap allocations made while building, sending and reading messages
+
+    void watch(int fd, uint32_t tag, uint32_t events) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.u32 = tag;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    // Start or stop the tick timer; the game only runs while someone plays it
+    void setTicking(bool on) {
+        long nanos = on ? TICK_MS * 1000000L : 0;
+        itimerspec period = {{0, nanos}, {0, nanos}};
+        timerfd_settime(timerFd, 0, &period, nullptr);
+    }
+
+    // Start a new game for the clients connected now
+    void startGame() {
+        game.reset(new Game(seed++));
+        game->setHeadless(true);
+        epoch++;
+        boardLevel = 0;
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if (clients[k].connection.isOpen()) game->addPlayer(k);
+        }
+        // Slot 0 comes with the board; without a client it is taken off again
+        if (!clients[0].connection.isOpen()) {
+            game->removePlayer(0);
+        }
+    }
+
+    // Write out what a client has queued, and watch for room in its socket while anything is left
+    void flushClient(int slot) {
+        Client& client = clients[slot];
+        if (!client.connection.flush()) {
+            leave(slot);
+            return;
+        }
+        if (client.connection.hasPending() != client.writing) {
+            client.writing = client.connection.hasPending();
+            epoll_event event = {};
+            event.events = EPOLLIN | (client.writing ? (uint32_t)EPOLLOUT : 0u);
+            event.data.u32 = slot;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, client.connection.getFd(), &event);
+        }
+    }
+
+    // Take in the connections waiting on the listening socket; each gets the first free slot
+    void acceptClients() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
                 return;
             }
+            int slot = 0;
+            while (slot < MAX_PLAYERS && clients[slot].connection.isOpen()) slot++;
+            if (slot == MAX_PLAYERS) {
+                NetHeader full = {0, NET_FULL, 0};
+                ::send(fd, &full, sizeof(full), MSG_NOSIGNAL);
+                close(fd);
+                continue;
+            }
+            join(slot, fd);
         }
+    }
 
-        // Player and trap collision
-        if (grid[player->getY()][player->getX()] && grid[player->getY()][player->getX()]->getSymbol() == TRAP) {
-            gameOver("Player stepped on a trap!");
+    // A client takes a slot; the first one starts a new game
+    void join(int slot, int fd) {
+        Client& client = clients[slot];
+        client.connection.attach(fd);
+        client.writing = false;
+        client.queueHead = client.queued = 0;
+        client.ackEpoch = 0;
+        watch(fd, slot, EPOLLIN);
+        if (clientCount++ == 0) {
+            startGame();
+            setTicking(true);
+        } else {
+            game->addPlayer(slot);
+        }
+        NetWelcome welcome = {(uint32_t)slot, WIDTH, HEIGHT};
+        client.connection.send(NET_WELCOME, &welcome, sizeof(welcome));
+        flushClient(slot);
+    }
+
+    // A client is gone (or misbehaved); its player leaves the board, and the game stops once nobody is left
+    void leave(int slot) {
+        Client& client = clients[slot];
+        if (!client.connection.isOpen()) {
             return;
         }
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, client.connection.getFd(), nullptr);
+        client.connection.close();
+        game->removePlayer(slot);
+        if (--clientCount == 0) {
+            setTicking(false);
+        }
+    }
 
-        // Enemy and trap collision
-        for (int i = 0; i < enemyCount; i++) {
-            int oldX = enemies[i]->getX(), oldY = enemies[i]->getY();
-            enemies[i]->update();
-            // Check if the new position is valid
-            if (!isValidMove(enemies[i]->getX(), enemies[i]->getY())) {
-                enemies[i]->move(oldX - enemies[i]->getX(), oldY - enemies[i]->getY()); // Move back if invalid
+    // Read what a client sent: actions are queued for their tick, pings are answered straight away
+    // and acknowledgements move the base of its next state on
+    void readClient(int slot) {
+        Client& client = clients[slot];
+        bool open = client.connection.receive();
+        NetHeader header;
+        unsigned char payload[NET_MAX_INPUT];
+        while (client.connection.next(header, payload, sizeof(payload))) {
+            if (header.type == NET_INPUT && header.size == sizeof(NetInput)) {
+                NetInput input;
+                memcpy(&input, payload, sizeof(input));
+                if (input.action > ACTION_NONE && input.action < NUM_ACTIONS && client.queued < NET_INPUT_QUEUE) {
+                    client.queue[(client.queueHead + client.queued++) % NET_INPUT_QUEUE] = input;
+                }
+            } else if (header.type == NET_PING && header.size == sizeof(NetPing)) {
+                client.connection.send(NET_PONG, payload, header.size);
+            } else if (header.type == NET_ACK && header.size == sizeof(NetAck)) {
+                NetAck ack;
+                memcpy(&ack, payload, sizeof(ack));
+                // Acknowledgements of another board, or of states not sent yet, are stale or made up
+                if (ack.epoch == epoch && ack.tick <= game->getTick() && (client.ackEpoch != epoch || ack.tick > client.ackTick)) {
+                    client.ackEpoch = ack.epoch;
+                    client.ackTick = ack.tick;
+                }
             }
+            // Other messages are skipped, so newer clients can talk to this server
+        }
+        if (!open || client.connection.isBroken()) {
+            leave(slot);
+            return;
         }
+        flushClient(slot);
+    }
 
-        // Bomb explosion
-        int i = 0;
-        while (i < bombCount) {
-            // Check if the bomb should explode
-            if (bombs[i]->shouldExplode()) {
-                explodeBomb(bombs[i]);
-                delete bombs[i];
-                bombs[i] = bombs[--bombCount];
+    // Send the same message to every client
+    void broadcast(int type, const iovec* parts, int count) {
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            if (clients[k].connection.isOpen()) {
+                clients[k].connection.send(type, parts, count);
+                flushClient(k);
+            }
+        }
+    }
+
+    // Send every client the state of this tick, built on the last one it acknowledged
+    void sendStates() {
+        long encodedBase = -2;      // Base of the state in encoded; -1 for the whole game
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            Client& client = clients[k];
+            if (!client.connection.isOpen()) {
+                continue;
+            }
+            bool full = client.ackEpoch != epoch || !game->canDeltaFrom(client.ackTick);
+            long base = full ? -1 : (long)client.ackTick;
+            if (base != encodedBase) {
+                BitWriter out(encoded);
+                game->writeDelta(out, epoch, client.ackTick, full);
+                out.finish();
+                encodedBase = base;
+            }
+            if (client.connection.send(NET_STATE, encoded.data(), encoded.size())) {
+                statesSent.fetch_add(1, memory_order_relaxed);
+                bytesSent.fetch_add(sizeof(NetHeader) + encoded.size(), memory_order_relaxed);
+                if (full) {
+                    fullStatesSent.fetch_add(1, memory_order_relaxed);
+                    fullBytesSent.fetch_add(sizeof(NetHeader) + encoded.size(), memory_order_relaxed);
+                }
             } else {
-                i++;
+                statesDropped.fetch_add(1, memory_order_relaxed);
             }
+            flushClient(k);
         }
+    }
 
-        // Check for level completion
-        if (player->getX() == exitDoor->getX() && player->getY() == exitDoor->getY() && exitDoor->isVisible()) {
-            // Handle level completion
-            gameWin();
-            return;
+    // Run one tick: the next action of every player, the update, and the states
+    void runTick() {
+        for (int k = 0; k < MAX_PLAYERS; k++) {
+            Client& client = clients[k];
+            if (client.connection.isOpen() && client.queued > 0) {
+                const NetInput& input = client.queue[client.queueHead];
+                game->applyAction(input.action, k);
+                game->setLastInput(k, input.sequence);
+                client.queueHead = (client.queueHead + 1) % NET_INPUT_QUEUE;
+                client.queued--;
+            }
+        }
+        game->update();
+
+        if (game->isFinished()) {
+            const string& result = game->getResult();
+            cout << "Game over after " << game->getTick() << " ticks: " << result << endl;
+            iovec text = {const_cast<char*>(result.data()), result.size()};
+            broadcast(NET_END, &text, 1);
+            startGame();
+        } else if (game->getCurrentLevel() != boardLevel) {
+            // Nothing of the old board is a base for the new one
+            boardLevel = game->getCurrentLevel();
+            epoch++;
         }
+
+        unsigned long allocationsBefore = threadAllocationCount;
+        sendStates();
+        messageAllocations.fetch_add(threadAllocationCount - allocationsBefore, memory_order_relaxed);
     }
 
-    // Function to run the game
-    void run() {
-        initscr();
-        cbreak();
-        noecho();
-        keypad(stdscr, TRUE);
-        curs_set(0);
+public:
+    explicit GameServer(uint64_t seed) : seed(seed) {}
 
-        while (true) {
-            displayMenu();
-            int choice = getch() - '0';
+    ~GameServer() {
+        for (int fd : {listenFd, epollFd, timerFd, wakeFd}) {
+            if (fd >= 0) close(fd);
+        }
+    }
 
-            // Start a new game
-            switch (choice) {
-                case 1:
-                    playGame();
-                    break;
-                case 2:
-                    if (loadGame()) {
-                        playGame();
-                    } else {
-                        mvprintw(HEIGHT / 2 + 2, WIDTH / 2 - 15, "No saved game found. Press any key to continue.");
-                        refresh();
-                        getch();
+    // Open the listening socket (port 0 picks a free one) and the reactor; false if the port cannot be used
+    bool listen(int port) {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        if (listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listenFd, 16) != 0) {
+            return false;
+        }
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || timerFd < 0 || wakeFd < 0) {
+            return false;
+        }
+        watch(listenFd, NET_TAG_LISTENER, EPOLLIN);
+        watch(timerFd, NET_TAG_TIMER, EPOLLIN);
+        watch(wakeFd, NET_TAG_WAKE, EPOLLIN);
+        return true;
+    }
+
+    // Port the server listens on
+    int getPort() const {
+        sockaddr_in address = {};
+        socklen_t length = sizeof(address);
+        getsockname(listenFd, (sockaddr*)&address, &length);
+        return ntohs(address.sin_port);
+    }
+
+    // Serve games until stop() is called
+    void run() {
+        epoll_event events[MAX_PLAYERS + 3];
+        while (!stopping) {
+            int count = epoll_wait(epollFd, events, MAX_PLAYERS + 3, -1);
+            for (int i = 0; i < count; i++) {
+                uint32_t tag = events[i].data.u32;
+                if (tag == NET_TAG_LISTENER) {
+                    acceptClients();
+                } else if (tag == NET_TAG_TIMER) {
+                    // A late wakeup finds several ticks due; after a long stall only one runs, as in playGame
+                    uint64_t due;
+                    if (read(timerFd, &due, sizeof(due)) == sizeof(due)) {
+                        for (uint64_t t = 0; t < (due > 2 ? 1 : due) && clientCount > 0; t++) {
+                            runTick();
+                        }
                     }
-                    break;
-                case 3:
-                    endwin();
-                    exit(0);
-                default:
-                    break;
+                } else if (tag == NET_TAG_WAKE) {
+                    stopping = true;
+                } else if (clients[tag].connection.isOpen()) {
+                    unsigned long allocationsBefore = threadAllocationCount;
+                    if (events[i].events & EPOLLOUT) {
+                        flushClient(tag);
+                    }
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                        readClient(tag);
+                    }
+                    messageAllocations.fetch_add(threadAllocationCount - allocationsBefore, memory_order_relaxed);
+                }
             }
         }
     }
 
+    // Make run() return; safe to call from another thread
+    void stop() {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            stopping = true;
+        }
+    }
 
-    // Function to play the game
-    void playGame() {
-        nodelay(stdscr, TRUE);
+    unsigned long getStatesSent() const { return statesSent.load(memory_order_relaxed); }
+    unsigned long getStatesDropped() const { return statesDropped.load(memory_order_relaxed); }
+    unsigned long getBytesSent() const { return bytesSent.load(memory_order_relaxed); }
+    unsigned long getFullStatesSent() const { return fullStatesSent.load(memory_order_relaxed); }
+    unsigned long getFullBytesSent() const { return fullBytesSent.load(memory_order_relaxed); }
+    unsigned long getMessageAllocations() const { return messageAllocations.load(memory_order_relaxed); }
+};
 
-        while (true) {
-            display();
-            int ch = getch();
+// Host network games until the process is stopped
+int runServer(int port, uint64_t seed) {
+    GameServer server(seed);
+    if (!server.listen(port)) {
+        cerr << "Cannot serve on port " << port << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    cout << "Serving games for up to " << MAX_PLAYERS << " players on port " << server.getPort() << endl;
+    server.run();
+    return 0;
+}
 
-            switch (ch) {
-                case 'w': case KEY_UP: movePlayer(0, -1); break;
-                case 's': case KEY_DOWN: movePlayer(0, 1); break;
-                case 'a': case KEY_LEFT: movePlayer(-1, 0); break;
-                case 'd': case KEY_RIGHT: movePlayer(1, 0); break;
-                case ' ': plantBomb(); break;
-                case 'e': saveGame(); break;
-                case 'q': case 'Q':{ 
-                    endwin();
-                    exit(0);
-                };
+/*
+-------------------------------------------------- Network Benchmark --------------------------------------------------
+*/
+
+// Measure the server against clients on the loopback interface: the round trip of a ping (the reactor and
+// the network stack alone), and the time from sending an action to receiving the first state it is part of,
+// which also waits for the next tick. The clients run on this thread and the server on its own; they apply
+// and acknowledge every state like the real client, so the states sent are change sets. The first client also
+// predicts like the real one, and every state rolls its prediction back NET_ROLLBACK_TICKS ticks, the most
+// a client ever resimulates.
+
+#define NET_BENCH_PINGS 1000
+#define NET_BENCH_INPUTS 100
+
+// Print the median, 99th percentile and maximum of samples in microseconds
+static void printLatency(const char* name, vector<uint32_t>& samples) {
+    sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    printf("%-16s p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms  (%zu samples)\n", name, samples[(n - 1) / 2] / 1000.0,
+           samples[(n - 1) * 99 / 100] / 1000.0, samples[n - 1] / 1000.0, n);
+}
+
+int netBenchmark(int clientCount) {
+    clientCount = max(1, min(clientCount, MAX_PLAYERS));
+    GameServer server(1);
+    if (!server.listen(0)) {
+        cerr << "Cannot open a server socket: " << strerror(errno) << endl;
+        return 1;
+    }
+    thread serverThread([&server]() { server.run(); });
+
+    vector<unique_ptr<NetConnection>> clients;
+    vector<unique_ptr<Game>> views;     // Each client's copy of the game
+    int slots[MAX_PLAYERS];
+    bool damaged = false;
+    vector<unsigned char> payload(NET_STATE_RING);
+    vector<uint32_t> pings, inputs, rollbacks;
+    pings.reserve(NET_BENCH_PINGS);
+    inputs.reserve(NET_BENCH_INPUTS);
+    rollbacks.reserve(NET_BENCH_PINGS);
+    unique_ptr<Game> prediction(new Game(0));   // The first client's prediction, and the actions it has not seen applied
+    prediction->setHeadless(true);
+    prediction->setPredicted(true);
+    vector<PredictedInput> unacknowledged;
+
+    // Read every client until done(client, header) takes a message; false after 5 seconds without one.
+    // States are applied to the client's game (and acknowledged) before done() sees them.
+    auto waitFor = [&](auto done) {
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+        pollfd fds[MAX_PLAYERS];
+        while (chrono::steady_clock::now() < deadline) {
+            for (size_t c = 0; c < clients.size(); c++) {
+                fds[c] = {clients[c]->getFd(), POLLIN, 0};
+            }
+            poll(fds, clients.size(), 100);
+            for (size_t c = 0; c < clients.size(); c++) {
+                if (!clients[c]->receive()) {
+                    return false;
+                }
+                NetHeader header;
+                bool found = false, applied = false;
+                while (clients[c]->next(header, payload.data(), payload.size())) {
+                    if (header.type == NET_STATE) {
+                        if (!views[c]->applyDelta(payload.data(), header.size)) {
+                            damaged = true;
+                            return false;
+                        }
+                        applied = true;
+                    }
+                    found = done(c, header) || found;
+                }
+                if (applied) {
+                    NetAck ack = {views[c]->getStateEpoch(), (uint32_t)views[c]->getTick()};
+                    clients[c]->send(NET_ACK, &ack, sizeof(ack));
+                    clients[c]->flush();
+                }
+                if (applied && c == 0) {
+                    auto start = chrono::steady_clock::now();
+                    prediction->setLocalSlot(slots[0]);
+                    prediction->predict(*views[0], unacknowledged, views[0]->getTick() + NET_ROLLBACK_TICKS);
+                    rollbacks.push_back(microsSince(start));
+                }
+                if (found) {
+                    return true;
+                }
             }
+        }
+        return false;
+    };
+
+    bool ok = true;
+    for (int c = 0; c < clientCount && ok; c++) {
+        clients.emplace_back(new NetConnection(NET_STATE_RING, NET_INPUT_RING));
+        views.emplace_back(new Game(0));
+        views.back()->setHeadless(true);
+        ok = clients.back()->connectTo("127.0.0.1", server.getPort()) && waitFor([&](size_t from, const NetHeader& header) {
+            if (from != (size_t)c || header.type != NET_WELCOME) return false;
+            slots[c] = reinterpret_cast<const NetWelcome*>(payload.data())->slot;
+            return true;
+        });
+    }
+    // Let the clients get the whole game, and the encoding buffer reach its working size, before measuring
+    for (int i = 0; i < 10 && ok; i++) {
+        ok = waitFor([](size_t from, const NetHeader& header) { return from == 0 && header.type == NET_STATE; });
+    }
+    unsigned long sentBefore = server.getStatesSent(), bytesBefore = server.getBytesSent();
+    unsigned long fullBefore = server.getFullStatesSent(), fullBytesBefore = server.getFullBytesSent();
+    unsigned long allocationsBefore = server.getMessageAllocations();
 
-            update();
-            this_thread::sleep_for(chrono::milliseconds(50));
+    for (int i = 0; i < NET_BENCH_PINGS && ok; i++) {
+        size_t c = i % clients.size();
+        NetPing ping = {steadyNanos()};
+        clients[c]->send(NET_PING, &ping, sizeof(ping));
+        clients[c]->flush();
+        ok = waitFor([&](size_t from, const NetHeader& header) {
+            if (from != c || header.type != NET_PONG) return false;
+            pings.push_back((steadyNanos() - reinterpret_cast<const NetPing*>(payload.data())->sentNanos) / 1000);
+            return true;
+        });
+    }
+    for (int i = 0; i < NET_BENCH_INPUTS && ok; i++) {
+        size_t c = i % clients.size();
+        // Step down and back up again, so the players stay in their corners
+        NetInput input = {(uint32_t)(i / clients.size() + 1), (uint32_t)(i / clients.size() % 2 ? ACTION_UP : ACTION_DOWN)};
+        // Inputs are sent at different points of the tick, as a player's keys would be
+        this_thread::sleep_for(chrono::milliseconds(i * 17 % TICK_MS));
+        auto sent = chrono::steady_clock::now();
+        clients[c]->send(NET_INPUT, &input, sizeof(input));
+        clients[c]->flush();
+        if (c == 0) {
+            unacknowledged.push_back({input.sequence, (int)input.action, views[0]->getTick()});
         }
+        ok = waitFor([&](size_t from, const NetHeader& header) {
+            if (from != c || header.type != NET_STATE) return false;
+            if (views[c]->getPlayer(slots[c])->getLastInput() < input.sequence) return false;
+            inputs.push_back(microsSince(sent));
+            return true;
+        });
     }
-};
+    unsigned long states = server.getStatesSent() - sentBefore;
+    unsigned long bytes = server.getBytesSent() - bytesBefore;
+    unsigned long fullStates = server.getFullStatesSent() - fullBefore;
+    unsigned long fullBytes = server.getFullBytesSent() - fullBytesBefore;
+    unsigned long allocations = server.getMessageAllocations() - allocationsBefore;
+
+    server.stop();
+    serverThread.join();
+    if (!ok) {
+        cerr << (damaged ? "The server sent a damaged state" : "The benchmark lost its connection to the server") << endl;
+        return 1;
+    }
+    // The whole game, as a client that just joined gets it
+    vector<unsigned char> whole;
+    BitWriter out(whole);
+    views[0]->writeDelta(out, 1, 0, true);
+    out.finish();
+
+    printf("Loopback benchmark: %d clients, %dx%d board, %d ms ticks\n", clientCount, WIDTH, HEIGHT, TICK_MS);
+    printLatency("Ping round trip", pings);
+    printLatency("Input to state", inputs);
+    char rollbackName[32];
+    snprintf(rollbackName, sizeof(rollbackName), "%d-tick rollback", NET_ROLLBACK_TICKS);
+    printLatency(rollbackName, rollbacks);
+    printf("States: %lu sent (%lu of them whole games), %lu dropped\n", states, fullStates, server.getStatesDropped());
+    printf("Bytes per state: %lu for changes, %zu for the whole game\n",
+           states > fullStates ? (bytes - fullBytes) / (states - fullStates) : 0, sizeof(NetHeader) + whole.size());
+    printf("Heap allocations while building, sending and reading messages: %lu\n", allocations);
+    return 0;
+}
 
 // Library to install (ncurses), for continuous keyboard input
 // sudo apt-get install libncurses5-dev libncursesw5-dev
@@ -759,10 +7201,122 @@ public:
 // g++ -o bomberman bomberman.cpp -lncurses
 // ./bomberman
 
-int main() {
-    srand(time(nullptr));
-    Game game;
+// Options:
+//   --observe <name>   publish the board as bit-planes in shared memory /dev/shm/<name>
+//   --observe-bytes    publish one byte per cell instead of packed bits
+//   --save-lz          compress the tiles of saves with LZ instead of run-length encoding
+//   --save-raw         store the tiles of saves uncompressed
+//   --seed <n>         generate the board from the given seed
+//   --record <file>    record the inputs of a new game to a replay file
+//   --replay <file>    play a replay back headlessly at full speed and check it against the recording
+//   --pack <file>      play the levels of a level pack instead of random boards
+//   --ansi             draw the board with ANSI escape sequences, one write per frame (for slow remote terminals)
+//   --session <file>   record the screen to a session file (changed cells only, with keyframes)
+//   --play-session <file> [--seek <seconds>]   watch a session recording, starting the given number of seconds in
+//   --make-pack <file> <level.txt>...   build a level pack from text exports
+//   --serve <port>     host a network game for up to 4 players (the board is generated from --seed)
+//   --connect <host>[:<port>]   join a network game
+//   --net-bench <clients>   measure the latency of a local server against loopback clients
+
+int main(int argc, char* argv[]) {
+    uint64_t seed = (uint64_t)time(nullptr);
+    string recordFile;
+    string sessionFile;
+    string playSessionFile;
+    double seekSeconds = 0;
+    string packFile;
+    bool useAnsi = false;
+    int servePort = -1;
+    string connectHost;
+    int connectPort = NET_PORT;
+    string observeName;
+    ObservationFormat observeFormat = OBS_BITS;
+    int saveCompression = SAVE_FLAG_RLE_TILES;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--observe" && i + 1 < argc) {
+            observeName = string("/") + argv[++i];
+        } else if (arg == "--observe-bytes") {
+            observeFormat = OBS_BYTES;
+        } else if (arg == "--save-lz") {
+            saveCompression = SAVE_FLAG_LZ_TILES;
+        } else if (arg == "--save-raw") {
+            saveCompression = 0;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            return playReplay(argv[++i]);
+        } else if (arg == "--session" && i + 1 < argc) {
+            sessionFile = argv[++i];
+        } else if (arg == "--play-session" && i + 1 < argc) {
+            playSessionFile = argv[++i];
+        } else if (arg == "--seek" && i + 1 < argc) {
+            seekSeconds = strtod(argv[++i], nullptr);
+        } else if (arg == "--ansi") {
+            useAnsi = true;
+        } else if (arg == "--pack" && i + 1 < argc) {
+            packFile = argv[++i];
+        } else if (arg == "--make-pack" && i + 1 < argc) {
+            return makeLevelPack(argv[i + 1], vector<string>(argv + i + 2, argv + argc));
+        } else if (arg == "--serve" && i + 1 < argc) {
+            servePort = atoi(argv[++i]);
+        } else if (arg == "--connect" && i + 1 < argc) {
+            connectHost = argv[++i];
+            size_t colon = connectHost.rfind(':');
+            if (colon != string::npos && connectHost.find(':') == colon) {
+                connectPort = atoi(connectHost.c_str() + colon + 1);
+                connectHost.erase(colon);
+            }
+        } else if (arg == "--net-bench" && i + 1 < argc) {
+            return netBenchmark(atoi(argv[++i]));
+        }
+    }
+
+    if (servePort >= 0) {
+        return runServer(servePort, seed);
+    }
+
+    if (!playSessionFile.empty()) {
+        return playSession(playSessionFile, seekSeconds);
+    }
+
+    LevelPack pack;
+    if (!packFile.empty() && !pack.open(packFile)) {
+        cerr << pack.getError() << endl;
+        return 1;
+    }
+
+    unique_ptr<Game> board(new Game(seed));
+    Game& game = *board;
+    game.setSaveCompression(saveCompression);
+    game.setReplayFile(recordFile);
+    game.setSessionFile(sessionFile);
+    if (pack.isOpen()) {
+        game.setLevelPack(&pack);
+    }
+    AnsiRenderer ansi(STDOUT_FILENO);
+    if (useAnsi) {
+        game.setRenderer(&ansi);
+    }
+    if (!connectHost.empty()) {
+        NetConnection server(NET_STATE_RING, NET_INPUT_RING);
+        if (!server.connectTo(connectHost, connectPort)) {
+            cerr << "Cannot connect to " << connectHost << ":" << connectPort << endl;
+            return 1;
+        }
+        return game.playOnline(server);
+    }
+    SharedObservation* observation = nullptr;
+    if (!observeName.empty()) {
+        observation = new SharedObservation(observeName, observeFormat);
+        if (observation->isOpen()) {
+            game.setTickListener([observation](const Game& g) { observation->publish(g); });
+        }
+    }
     game.run();
+    delete observation;
     return 0;
 }
 